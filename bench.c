@@ -0,0 +1,574 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Headless benchmarks for dwm internals. dwm.c is included as a whole so its
+ * static functions can be driven directly; nothing in here needs an X server.
+ * Build with `make bench` and run ./bench.
+ */
+#include <stdlib.h>
+#include <time.h>
+
+/* count the allocations made by dwm.c and s_layout.c */
+static unsigned long nallocs;
+static void *countmalloc(size_t size);
+static void *countcalloc(size_t nmemb, size_t size);
+#define malloc countmalloc
+#define calloc countcalloc
+#define main dwmmain
+#include "dwm.c"
+#undef main
+#undef malloc
+#undef calloc
+
+static void *volatile sink; /* keeps results of timed loops alive */
+
+/* s-expression schemes run through s_layout(), see the top of s_layout.c */
+static const char *schemes[] = {
+	"h c (v ...)",
+	"v ...",
+	"h c (v 3)",
+	"h (v (c weight: 1.2) 1) (v (rest))",
+	"m ...",
+};
+
+static void *
+countmalloc(size_t size)
+{
+	nallocs++;
+	return malloc(size);
+}
+
+static void *
+countcalloc(size_t nmemb, size_t size)
+{
+	nallocs++;
+	return calloc(nmemb, size);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double
+cpunow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the lookup wintoclient() did before the window index */
+static Client *
+linearwintoclient(Window w)
+{
+	Client *c;
+	Monitor *m;
+
+	for (m = mons; m; m = m->next)
+		for (c = m->clients; c; c = c->next)
+			if (c->win == w)
+				return c;
+	return NULL;
+}
+
+static void
+benchwinmap(unsigned int n)
+{
+	const unsigned int lookups = 1000000;
+	Client *c;
+	Window *wins;
+	unsigned int i;
+	double t0, thash, tlinear;
+
+	/* X hands out ids from a per-connection base, so spread clients
+	 * across bases like real applications do */
+	wins = ecalloc(n + n / 4, sizeof(Window));
+	for (i = 0; i < n; i++) {
+		c = ecalloc(1, sizeof(Client));
+		c->win = wins[i] = ((Window)(i % 64 + 1) << 21) | (i / 64 * 0x1000 + 0x0d);
+		c->mon = selmon;
+		attach(c);
+		winmapadd(c->win, WinClient, c);
+	}
+	/* a quarter of the events arrive for windows dwm does not manage */
+	for (; i < n + n / 4; i++)
+		wins[i] = ((Window)(i % 64 + 65) << 21) | 0x01;
+
+	t0 = now();
+	for (i = 0; i < lookups; i++)
+		sink = wintoclient(wins[i % (n + n / 4)]);
+	thash = (now() - t0) / lookups;
+	t0 = now();
+	for (i = 0; i < lookups; i++)
+		sink = linearwintoclient(wins[i % (n + n / 4)]);
+	tlinear = (now() - t0) / lookups;
+	printf("wintoclient  %5u clients  %8.1f ns/event  (linear walk %8.1f ns/event)\n",
+		n, thash, tlinear);
+
+	while ((c = selmon->clients)) {
+		detach(c);
+		winmapdel(c->win, WinClient);
+		free(c);
+	}
+	free(wins);
+}
+
+/* Run one layout over n tiled clients. Layouts only record geometry while
+ * batching, so this is the layout math alone. mfact alternates so every pass
+ * moves clients, like setmfact() would. */
+static void
+benchlayout(const Layout *l, const char *scheme, unsigned int n)
+{
+	const unsigned int iters = MAX(5, 200000 / n);
+	const float mfact = selmon->mfact;
+	Client *c;
+	unsigned int i;
+	unsigned long allocs;
+	double t0, t;
+
+	for (i = 0; i < n; i++) {
+		c = ecalloc(1, sizeof(Client));
+		c->win = i + 1;
+		c->tags = 1;
+		c->bw = borderpx;
+		c->mon = selmon;
+		attach(c);
+	}
+	selmon->lt[selmon->sellt] = l;
+
+	batching = 1;
+	arrangemon(selmon); /* warm up */
+	allocs = nallocs;
+	t0 = now();
+	for (i = 0; i < iters; i++) {
+		selmon->mfact = i & 1 ? mfact + 0.05 : mfact;
+		arrangemon(selmon);
+	}
+	t = (now() - t0) / iters;
+	allocs = nallocs - allocs;
+	batching = 0;
+	selmon->mfact = mfact;
+
+	printf("layout %-4s %-36s %5u clients %12.1f ns/arrange %8.1f ns/client %8.1f allocs/arrange\n",
+		l->symbol, scheme ? scheme : "", n, t, t / n, (double)allocs / iters);
+
+	while ((c = selmon->clients)) {
+		detach(c);
+		free(c);
+	}
+}
+
+static void
+benchlayouts(void)
+{
+	const unsigned int sizes[] = { 1, 10, 100, 1000, 10000 };
+	struct string_token_t *tokens, *t;
+	unsigned int i, j, k;
+
+	selmon->wx = 0;
+	selmon->wy = bh = 20;
+	selmon->ww = 1920;
+	selmon->wh = 1060;
+	for (i = 0; i < LENGTH(layouts); i++) {
+		if (!layouts[i].arrange)
+			continue;
+		if (layouts[i].arrange != s_layout) {
+			for (j = 0; j < LENGTH(sizes); j++)
+				benchlayout(&layouts[i], NULL, sizes[j]);
+			continue;
+		}
+		for (k = 0; k < LENGTH(schemes); k++) {
+			tokens = t = tokenize_string((char *)schemes[k]);
+			s_layout_scheme = parse_sexp(&t);
+			for (j = 0; j < LENGTH(sizes); j++)
+				benchlayout(&layouts[i], schemes[k], sizes[j]);
+			free_node(s_layout_scheme);
+			s_layout_scheme = NULL;
+			for (; tokens; tokens = t) {
+				t = tokens->next;
+				free(tokens);
+			}
+		}
+	}
+}
+
+/* the round trips manage() made before it prefetched properties */
+static void
+xlibprops(Client *c)
+{
+	XClassHint ch = { NULL, NULL };
+	XSizeHints size;
+	XWMHints *wmh;
+	Window trans;
+	long msize;
+	int format;
+	unsigned long n, extra;
+	unsigned char *p = NULL;
+	Atom real;
+
+	if (XGetWindowProperty(dpy, c->win, netatom[NetWMIcon], 0L, LONG_MAX, False,
+		AnyPropertyType, &real, &format, &n, &extra, &p) == Success && p)
+		XFree(p);
+	if (!gettextprop(c->win, netatom[NetWMName], c->name, sizeof c->name))
+		gettextprop(c->win, XA_WM_NAME, c->name, sizeof c->name);
+	XGetTransientForHint(dpy, c->win, &trans);
+	if (XGetClassHint(dpy, c->win, &ch)) {
+		XFree(ch.res_class);
+		XFree(ch.res_name);
+	}
+	getatomprop(c, netatom[NetWMState]);
+	getatomprop(c, netatom[NetWMWindowType]);
+	XGetWMNormalHints(dpy, c->win, &size, &msize);
+	if ((wmh = XGetWMHints(dpy, c->win)))
+		XFree(wmh);
+}
+
+/* Property fetching for a burst of new windows, needs an X server. */
+static void
+benchprops(unsigned int n)
+{
+	const unsigned int iconw = 48, iconh = 48;
+	XClassHint ch = { "bench", "Bench" };
+	XSizeHints size = { .flags = PMinSize, .min_width = 100, .min_height = 100 };
+	XWMHints wmh = { .flags = InputHint, .input = True };
+	unsigned long *icon;
+	Client *c;
+	Props *p;
+	unsigned int i;
+	double t0, txlib, tone, tburst;
+
+	c = ecalloc(n, sizeof(Client));
+	p = ecalloc(n, sizeof(Props));
+	icon = ecalloc(2 + iconw * iconh, sizeof(unsigned long));
+	icon[0] = iconw;
+	icon[1] = iconh;
+	for (i = 0; i < n; i++) {
+		c[i].win = XCreateSimpleWindow(dpy, root, 0, 0, 100, 100, 0, 0, 0);
+		XStoreName(dpy, c[i].win, "a window title of typical length - bench");
+		XSetClassHint(dpy, c[i].win, &ch);
+		XSetWMNormalHints(dpy, c[i].win, &size);
+		XSetWMHints(dpy, c[i].win, &wmh);
+		XChangeProperty(dpy, c[i].win, netatom[NetWMIcon], XA_CARDINAL, 32,
+			PropModeReplace, (unsigned char *)icon, 2 + iconw * iconh);
+	}
+	XSync(dpy, False);
+
+	t0 = now();
+	for (i = 0; i < n; i++)
+		xlibprops(&c[i]);
+	txlib = (now() - t0) / n;
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		propsfetch(&p[i], c[i].win, (1 << PropLast) - 1);
+		propsget(&p[i]);
+		propsfree(&p[i]);
+	}
+	tone = (now() - t0) / n;
+	t0 = now();
+	for (i = 0; i < n; i++)
+		propsfetch(&p[i], c[i].win, (1 << PropLast) - 1);
+	for (i = 0; i < n; i++) {
+		propsget(&p[i]);
+		propsfree(&p[i]);
+	}
+	tburst = (now() - t0) / n;
+	printf("manage props %4u windows  %8.1f us/window xlib  %8.1f us/window prefetched  %8.1f us/window burst\n",
+		n, txlib / 1e3, tone / 1e3, tburst / 1e3);
+
+	for (i = 0; i < n; i++)
+		XDestroyWindow(dpy, c[i].win);
+	XSync(dpy, False);
+	free(icon);
+	free(p);
+	free(c);
+}
+
+/* the per-pixel premultiply geticonprop() did before drw_premultiply() */
+static uint32_t
+prealpha(uint32_t p)
+{
+	uint8_t a = p >> 24u;
+	uint32_t rb = (a * (p & 0xFF00FFu)) >> 8u;
+	uint32_t g = (a * (p & 0x00FF00u)) >> 8u;
+	return (rb & 0xFF00FFu) | (g & 0x00FF00u) | (a << 24u);
+}
+
+/* The icon kernels on an s x s source shrunk to ICONSIZE, no X needed. For
+ * the Imlib2 scaler they replace, compare drwbench runs before and after. */
+static void
+benchiconkernels(unsigned int s)
+{
+	const unsigned int iters = 200;
+	uint32_t *px, *dst;
+	unsigned int i, n;
+	double t0, tloop, tkernel, tdown;
+
+	px = ecalloc(s * s, sizeof(uint32_t));
+	dst = ecalloc(ICONSIZE * ICONSIZE, sizeof(uint32_t));
+	for (n = 0; n < s * s; n++)
+		px[n] = (n % 251) << 24 | n * 2654435761u >> 8;
+	t0 = now();
+	for (i = 0; i < iters; i++)
+		for (n = 0; n < s * s; n++)
+			px[n] = prealpha(px[n]);
+	tloop = (now() - t0) / iters;
+	t0 = now();
+	for (i = 0; i < iters; i++)
+		drw_premultiply(px, s * s);
+	tkernel = (now() - t0) / iters;
+	t0 = now();
+	for (i = 0; i < iters; i++)
+		drw_downscale(px, s, s, dst, ICONSIZE, ICONSIZE);
+	tdown = (now() - t0) / iters;
+	sink = dst;
+	printf("icon %3ux%-3u  premultiply %8.1f us per pixel loop  %8.1f us drw_premultiply  downscale to %u %8.1f us\n",
+		s, s, tloop / 1e3, tkernel / 1e3, ICONSIZE, tdown / 1e3);
+	free(px);
+	free(dst);
+}
+
+/* iconqueue() for n clients shipping the same icons from 16 to 512 pixels,
+ * like Chromium and Electron applications do */
+static void
+benchicon(unsigned int n)
+{
+	const unsigned int sizes[] = { 16, 24, 32, 48, 64, 128, 256, 512 };
+	const unsigned int iters = 100;
+	unsigned long *icon, len = 0, off = 0, b0, r0, h0, m0, s0;
+	Client *c;
+	unsigned int i, j;
+	double t0, tfirst;
+
+	for (i = 0; i < LENGTH(sizes); i++)
+		len += 2 + sizes[i] * sizes[i];
+	icon = ecalloc(len, sizeof(unsigned long));
+	for (i = 0; i < LENGTH(sizes); i++) {
+		icon[off++] = sizes[i];
+		icon[off++] = sizes[i];
+		for (j = 0; j < sizes[i] * sizes[i]; j++)
+			icon[off++] = 0xff000000 | j;
+	}
+	c = ecalloc(n, sizeof(Client));
+	for (i = 0; i < n; i++) {
+		c[i].win = XCreateSimpleWindow(dpy, root, 0, 0, 100, 100, 0, 0, 0);
+		XChangeProperty(dpy, c[i].win, netatom[NetWMIcon], XA_CARDINAL, 32,
+			PropModeReplace, (unsigned char *)icon, len);
+	}
+	XSync(dpy, False);
+
+	/* every client showing it, the first one uploads */
+	h0 = iconhits;
+	m0 = iconmisses;
+	s0 = iconsaved;
+	t0 = now();
+	iconqueue(&c[0]);
+	XSync(dpy, False);
+	tfirst = now() - t0;
+	t0 = now();
+	for (i = 1; i < n; i++)
+		iconqueue(&c[i]);
+	XSync(dpy, False);
+	t0 = now() - t0;
+	printf("icon cache %4u windows  %lu uploads  %lu shared  %8lu bytes saved  %8.1f us first  %8.1f us/window after\n",
+		n, iconmisses - m0, iconhits - h0, iconsaved - s0, tfirst / 1e3, n > 1 ? t0 / (n - 1) / 1e3 : 0.0);
+
+	/* the same client again, the fetch is what is left */
+	b0 = iconbytes;
+	r0 = iconreads;
+	t0 = now();
+	for (i = 0; i < iters; i++)
+		iconqueue(&c[0]);
+	t0 = now() - t0;
+	printf("icon load %lu byte property  %8.1f us/call  %8lu bytes/call  %5.1f reads/call\n",
+		len * 4, t0 / iters / 1e3, (iconbytes - b0) / iters, (double)(iconreads - r0) / iters);
+
+	for (i = 0; i < n; i++) {
+		freeicon(&c[i]);
+		XDestroyWindow(dpy, c[i].win);
+	}
+	XSync(dpy, False);
+	free(icon);
+	free(c);
+}
+
+/* drawbar() with n visible clients, measuring every string like before the
+ * width cache and with the cache warm */
+static void
+benchdrawbar(unsigned int n)
+{
+	const unsigned int iters = 200;
+	Client *c;
+	unsigned int i;
+	unsigned long r0, d0, px0;
+	double t0, c0, tcold, twarm, tcpu, ttick;
+
+	for (i = 0; i < n; i++) {
+		c = ecalloc(1, sizeof(Client));
+		c->win = i + 1;
+		c->tags = 1;
+		c->mon = selmon;
+		snprintf(c->name, sizeof c->name, "client %u - some document title.txt", i);
+		attach(c);
+		attachstack(c);
+	}
+	selmon->sel = selmon->clients;
+
+	t0 = now();
+	for (i = 0; i < iters; i++) {
+		drw_wcache_flush(drw);
+		selmon->nseg = 0; /* render every segment */
+		drawbar(selmon);
+	}
+	XSync(dpy, False);
+	tcold = (now() - t0) / iters;
+	drawbar(selmon);
+	XSync(dpy, False);
+	r0 = NextRequest(dpy);
+	t0 = now();
+	c0 = cpunow();
+	for (i = 0; i < iters; i++) {
+		selmon->nseg = 0;
+		drawbar(selmon);
+	}
+	tcpu = (cpunow() - c0) / iters;
+	XSync(dpy, False);
+	twarm = (now() - t0) / iters;
+	printf("drawbar     %5u clients  %8.1f us/redraw uncached  %8.1f us/redraw cached  %8.1f us cpu  %6.1f requests/redraw\n",
+		n, tcold / 1e3, twarm / 1e3, tcpu / 1e3, (double)(NextRequest(dpy) - r0 - 1) / iters);
+
+	/* a status clock ticking: only the status segment changes */
+	d0 = segdrawn;
+	px0 = barpixelhist.total;
+	t0 = now();
+	for (i = 0; i < iters; i++) {
+		snprintf(stext, sizeof stext, "12:00:%02u", i % 60);
+		drawbar(selmon);
+	}
+	XSync(dpy, False);
+	ttick = (now() - t0) / iters;
+	printf("drawbar     %5u clients  %8.1f us/status tick  %6.1f segments  %8.1f pixels rendered per tick\n",
+		n, ttick / 1e3, (double)(segdrawn - d0) / iters, (double)(barpixelhist.total - px0) / iters);
+
+	while ((c = selmon->clients)) {
+		detach(c);
+		detachstack(c);
+		free(c);
+	}
+	selmon->sel = NULL;
+}
+
+/* Cut 1 KB titles to a bar cell: the old byte-at-a-time shrink loop against
+ * drw_text(), which cuts on codepoint boundaries by binary search. */
+static void
+benchtruncate(void)
+{
+	const unsigned int iters = 200, cellw = 300;
+	static const char *words[] = { "document", "caf\xc3\xa9", "\xe2\x80\x94", "r\xc3\xa9sum\xc3\xa9", "Mozilla", "\xd0\x9f\xd1\x80\xd0\xb8" };
+	char title[1024];
+	XGlyphInfo ext;
+	size_t len, n;
+	unsigned int i, w;
+	double t0, told, tnew;
+
+	for (n = 0, i = 0; n + 16 < sizeof(title); i++)
+		n += snprintf(title + n, sizeof(title) - n, "%s ", words[i % LENGTH(words)]);
+	drw_setscheme(drw, scheme[SchemeNorm]);
+
+	t0 = now();
+	for (i = 0; i < iters; i++) {
+		XftTextExtentsUtf8(dpy, drw->fonts->xfont, (XftChar8 *)title, n, &ext);
+		for (len = n, w = ext.xOff; len && w > cellw; len--) {
+			XftTextExtentsUtf8(dpy, drw->fonts->xfont, (XftChar8 *)title, len, &ext);
+			w = ext.xOff;
+		}
+	}
+	told = (now() - t0) / iters;
+	t0 = now();
+	for (i = 0; i < iters; i++)
+		drw_text(drw, 0, 0, cellw, bh, 0, title, 0);
+	XSync(dpy, False);
+	tnew = (now() - t0) / iters;
+	printf("truncate    %5zu bytes    %8.1f us/title byte loop  %8.1f us/title drw_text (%s advances)\n",
+		n, told / 1e3, tnew / 1e3, drw->fonts->additive ? "summed" : "xft");
+}
+
+/* A title cut inside its first font run must end with that run's ellipsis:
+ * drawn into the same cell, it has to match the first run alone. */
+static void
+benchellipsis(void)
+{
+	const char *plain = "Mozilla Firefox r\xc3\xa9sum\xc3\xa9 document ";
+	const char *mixed = "Mozilla Firefox r\xc3\xa9sum\xc3\xa9 document "
+		"\xe6\x96\x87\xe6\xa1\xa3 \xf0\x9f\x98\x80 tail";
+	unsigned int w = drw_fontset_getwidth(drw, plain) / 2;
+	Buf *a = drw_buf_create(drw, w, bh), *b = drw_buf_create(drw, w, bh), *prev = drw->buf;
+	XImage *ia, *ib;
+
+	drw_setscheme(drw, scheme[SchemeNorm]);
+	drw_setbuf(drw, a);
+	drw_text(drw, 0, 0, w, bh, 0, plain, 0);
+	drw_setbuf(drw, b);
+	drw_text(drw, 0, 0, w, bh, 0, mixed, 0);
+	drw_setbuf(drw, prev);
+	ia = XGetImage(dpy, a->drawable, 0, 0, w, bh, AllPlanes, ZPixmap);
+	ib = XGetImage(dpy, b->drawable, 0, 0, w, bh, AllPlanes, ZPixmap);
+	printf("ellipsis    %5u px cell   %s\n", w,
+		memcmp(ia->data, ib->data, (size_t)ia->bytes_per_line * bh) ? "FAIL: text drawn past the ellipsis" : "ok");
+	XDestroyImage(ia);
+	XDestroyImage(ib);
+	drw_buf_free(drw, a);
+	drw_buf_free(drw, b);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t i;
+
+	mons = selmon = createmon();
+	benchwinmap(10);
+	benchwinmap(100);
+	benchwinmap(1000);
+	benchlayouts();
+	benchiconkernels(256);
+	benchiconkernels(512);
+
+	if (!(dpy = XOpenDisplay(NULL))) {
+		puts("no display, skipping X benchmarks");
+		return EXIT_SUCCESS;
+	}
+	xcon = XGetXCBConnection(dpy);
+	root = DefaultRootWindow(dpy);
+	netatom[NetWMName] = XInternAtom(dpy, "_NET_WM_NAME", False);
+	netatom[NetWMIcon] = XInternAtom(dpy, "_NET_WM_ICON", False);
+	netatom[NetWMState] = XInternAtom(dpy, "_NET_WM_STATE", False);
+	netatom[NetWMWindowType] = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False);
+	benchprops(1);
+	benchprops(20);
+
+	screen = DefaultScreen(dpy);
+	sw = DisplayWidth(dpy, screen);
+	sh = DisplayHeight(dpy, screen);
+	drw = drw_create(dpy, screen, root, 1, 1);
+	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
+		die("no fonts could be loaded.");
+	lrpad = drw->fonts->h;
+	bh = drw->fonts->h + 2;
+	scheme = ecalloc(LENGTH(colors), sizeof(Clr *));
+	for (i = 0; i < LENGTH(colors); i++)
+		scheme[i] = drw_scm_create(drw, colors[i], 3);
+	systray = ecalloc(1, sizeof(Systray));
+	selmon->ww = sw;
+	selmon->barwin = XCreateSimpleWindow(dpy, root, 0, 0, sw, bh, 0, 0, 0);
+	benchicon(50);
+	benchdrawbar(50);
+	benchtruncate();
+	benchellipsis();
+	XCloseDisplay(dpy);
+	return EXIT_SUCCESS;
+}
@@ -6,6 +6,7 @@
 #define MAX_TAGLEN 16
 #define ICONSIZE 20
 #define ICONSPACING 2
+#define ICONBUDGET (256 * 1024) /* bytes of icon Pictures kept, those of hidden clients go first */
 
 /* appearance */
 static const unsigned int borderpx  = 5;        /* border pixel of windows */
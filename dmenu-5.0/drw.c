@@ -10,6 +10,7 @@
 
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
+#define TEXT_SIZ    1024 /* bytes drw_text() draws from one font run */
 
 static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -60,17 +61,71 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+static void
+fcacheflush(Drw *drw)
+{
+	int i;
+
+	for (i = 0; i < FCACHESIZE; i++)
+		drw->fcache[i] = (Fentry){ -1, NULL };
+	drw->fcount = 0;
+}
+
+static Fentry *
+fcacheslot(Drw *drw, long u)
+{
+	unsigned int i = (unsigned long)u * 2654435761u & (FCACHESIZE - 1);
+
+	while (drw->fcache[i].cp != -1 && drw->fcache[i].cp != u)
+		i = (i + 1) & (FCACHESIZE - 1);
+	return &drw->fcache[i];
+}
+
+static void
+fcacheput(Drw *drw, long u, Fnt *font)
+{
+	Fentry *e;
+
+	if (drw->fcount >= FCACHESIZE / 4 * 3)
+		fcacheflush(drw);
+	if ((e = fcacheslot(drw, u))->cp == -1)
+		drw->fcount++;
+	e->cp = u;
+	e->font = font;
+}
+
+/* Font that draws u: the first loaded font covering it, or the primary font
+ * when no font on the system does. NULL until u has been resolved. */
+static Fnt *
+fontfor(Drw *drw, long u)
+{
+	Fentry *e;
+	Fnt *f;
+
+	if ((e = fcacheslot(drw, u))->cp == u)
+		return e->font ? e->font : drw->fonts;
+	for (f = drw->fonts; f; f = f->next)
+		if (XftCharExists(drw->dpy, f->xfont, u)) {
+			fcacheput(drw, u, f);
+			return f;
+		}
+	return NULL;
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h)
 {
 	Drw *drw = ecalloc(1, sizeof(Drw));
 
+	fcacheflush(drw);
 	drw->dpy = dpy;
 	drw->screen = screen;
 	drw->root = root;
 	drw->w = w;
 	drw->h = h;
 	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+	drw->xftdraw = XftDrawCreate(dpy, drw->drawable, DefaultVisual(dpy, screen),
+	                             DefaultColormap(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
@@ -88,17 +143,58 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	XftDrawChange(drw->xftdraw, drw->drawable);
 }
 
 void
 drw_free(Drw *drw)
 {
+	XftDrawDestroy(drw->xftdraw);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	drw_fontset_free(drw->fonts);
 	free(drw);
 }
 
+/* advance of codepoint u in the BMP, asked from Xft only the first time */
+static unsigned int
+glyphadv(Fnt *font, long u)
+{
+	unsigned short *a;
+	XGlyphInfo ext;
+	FT_UInt g;
+
+	if (u < 256) {
+		a = &font->latin[u];
+	} else {
+		if (!font->bmp[u >> 8])
+			font->bmp[u >> 8] = ecalloc(256, sizeof(unsigned short));
+		a = &font->bmp[u >> 8][u & 0xFF];
+	}
+	if (!*a) {
+		g = XftCharIndex(font->dpy, font->xfont, u);
+		XftGlyphExtents(font->dpy, font->xfont, &g, 1, &ext);
+		*a = MAX(ext.xOff, 0) + 1;
+	}
+	return *a - 1;
+}
+
+/* Xft positions glyphs by their advances alone, so summing the table gives
+ * the same width as XftTextExtentsUtf8. Check it on kerning pairs anyway and
+ * let fonts that disagree fall back to Xft for every string. */
+static int
+isadditive(Fnt *font)
+{
+	static const char probe[] = "AVAWToTaYoLT";
+	XGlyphInfo ext;
+	unsigned int i, w = 0;
+
+	for (i = 0; probe[i]; i++)
+		w += glyphadv(font, probe[i]);
+	XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)probe, sizeof(probe) - 1, &ext);
+	return w == (unsigned int)ext.xOff;
+}
+
 /* This function is an implementation detail. Library users should use
  * drw_fontset_create instead.
  */
@@ -151,6 +247,7 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 	font->pattern = pattern;
 	font->h = xfont->ascent + xfont->descent;
 	font->dpy = drw->dpy;
+	font->additive = isadditive(font);
 
 	return font;
 }
@@ -158,8 +255,12 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 static void
 xfont_free(Fnt *font)
 {
+	size_t i;
+
 	if (!font)
 		return;
+	for (i = 0; i < 256; i++)
+		free(font->bmp[i]);
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
 	XftFontClose(font->dpy, font->xfont);
@@ -175,6 +276,7 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 	if (!drw || !fonts)
 		return NULL;
 
+	fcacheflush(drw);
 	for (i = 1; i <= fontcount; i++) {
 		if ((cur = xfont_create(drw, fonts[fontcount - i], NULL))) {
 			cur->next = ret;
@@ -225,8 +327,10 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
+	if (drw && drw->fonts != set) {
 		drw->fonts = set;
+		fcacheflush(drw);
+	}
 }
 
 void
@@ -248,23 +352,102 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
+/* Look for a font covering u and append it to the fontset. Codepoints no font
+ * covers are remembered so fontconfig is not asked again on every redraw. */
+static void
+fallback(Drw *drw, long u)
+{
+	FcCharSet *fccharset;
+	FcPattern *fcpattern;
+	FcPattern *match;
+	XftResult result;
+	Fnt *usedfont, *curfont;
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, u);
+
+	fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+	FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
+
+	FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+	match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+
+	FcCharSetDestroy(fccharset);
+	FcPatternDestroy(fcpattern);
+
+	if (match) {
+		usedfont = xfont_create(drw, NULL, match);
+		if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, u)) {
+			for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
+				; /* NOP */
+			curfont->next = usedfont;
+			fcacheput(drw, u, usedfont);
+			return;
+		}
+		xfont_free(usedfont);
+	}
+	/* Regardless of whether or not a fallback font is found, the
+	 * character must be drawn. */
+	fcacheput(drw, u, NULL);
+}
+
+/* Longest prefix of text, cut on a codepoint boundary, that is at most w
+ * wide. Binary search over the codepoint boundaries; for additive fonts the
+ * prefix widths are summed up front so each probe is a lookup. */
+static size_t
+fitprefix(Fnt *font, const char *text, size_t len, unsigned int w, unsigned int *ew)
+{
+	size_t off[TEXT_SIZ + 1], n, i, c, lo, hi, mid;
+	unsigned int sum[TEXT_SIZ + 1], x, cw;
+	long u;
+
+	for (n = 0, i = 0, x = 0; i < len && n < TEXT_SIZ; n++, i += c) {
+		if (!(c = utf8decode(text + i, &u, len - i)))
+			break;
+		off[n] = i;
+		sum[n] = x;
+		if (font->additive) {
+			drw_font_getexts(font, text + i, c, &cw, NULL);
+			x += cw;
+		}
+	}
+	off[n] = MIN(i, len);
+	sum[n] = x;
+
+	*ew = 0;
+	for (lo = 0, hi = n; lo < hi;) {
+		mid = (lo + hi + 1) / 2;
+		if (!font->additive)
+			drw_font_getexts(font, text, off[mid], &sum[mid], NULL);
+		if (sum[mid] <= w) {
+			lo = mid;
+			*ew = sum[mid];
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return off[lo];
+}
+
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
-	char buf[1024];
+	char buf[TEXT_SIZ];
 	int ty;
-	unsigned int ew;
-	XftDraw *d = NULL;
+	unsigned int ew, dw;
 	Fnt *usedfont, *curfont, *nextfont;
-	size_t i, len;
-	int utf8strlen, utf8charlen, render = x || y || w || h;
+	size_t len;
+	int utf8strlen, utf8charlen, cut = 0, render = x || y || w || h;
 	long utf8codepoint = 0;
 	const char *utf8str;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern;
-	FcPattern *match;
-	XftResult result;
-	int charexists = 0;
 
 	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
 		return 0;
@@ -274,9 +457,6 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	} else {
 		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
 		x += lpad;
 		w -= lpad;
 	}
@@ -288,41 +468,42 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
-				}
-			}
-
-			if (!charexists || nextfont)
+			if (!(curfont = fontfor(drw, utf8codepoint)))
 				break;
-			else
-				charexists = 0;
+			if (curfont != usedfont) {
+				nextfont = curfont;
+				break;
+			}
+			utf8strlen += utf8charlen;
+			text += utf8charlen;
 		}
 
 		if (utf8strlen) {
 			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
+			len = utf8strlen;
+			if (ew <= w && len < sizeof(buf)) {
+				memcpy(buf, utf8str, len);
+			} else {
+				/* shorten text to what fits before an ellipsis, which ends the line */
+				cut = 1;
+				drw_font_getexts(usedfont, "...", 3, &dw, NULL);
+				len = dw < w ? fitprefix(usedfont, utf8str, MIN(len, sizeof(buf) - 4), w - dw, &ew) : 0;
+				if (len) {
+					memcpy(buf, utf8str, len);
+					memcpy(buf + len, "...", 3);
+					len += 3;
+					ew += dw;
+				} else {
+					len = fitprefix(usedfont, "...", 3, w, &ew);
+					memcpy(buf, "...", len);
+				}
+			}
 
 			if (len) {
-				memcpy(buf, utf8str, len);
 				buf[len] = '\0';
-				if (len < utf8strlen)
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
-
 				if (render) {
 					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
+					XftDrawStringUtf8(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg],
 					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
 				}
 				x += ew;
@@ -330,51 +511,14 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 			}
 		}
 
-		if (!*text) {
+		if (cut || !*text) {
 			break;
 		} else if (nextfont) {
-			charexists = 0;
 			usedfont = nextfont;
 		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
-
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-			FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					usedfont = drw->fonts;
-				}
-			}
+			fallback(drw, utf8codepoint);
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
 
 	return x + (render ? w : 0);
 }
@@ -401,13 +545,29 @@ void
 drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h)
 {
 	XGlyphInfo ext;
+	unsigned int i, n, sum = 0;
+	long u;
 
 	if (!font || !text)
 		return;
 
-	XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+	for (i = 0; font->additive && i < len; i += n) {
+		if ((unsigned char)text[i] < 0x80) {
+			sum += glyphadv(font, text[i]);
+			n = 1;
+			continue;
+		}
+		n = utf8decode(text + i, &u, len - i);
+		if (!n || u == UTF_INVALID || u > 0xFFFF)
+			break; /* leave malformed text and astral planes to Xft */
+		sum += glyphadv(font, u);
+	}
+	if (i < len) {
+		XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+		sum = ext.xOff;
+	}
 	if (w)
-		*w = ext.xOff;
+		*w = sum;
 	if (h)
 		*h = font->h;
 }
@@ -10,20 +10,34 @@ typedef struct Fnt {
 	XftFont *xfont;
 	FcPattern *pattern;
 	struct Fnt *next;
+	/* glyph advances plus one, zero until first looked up */
+	unsigned short latin[256];    /* U+0000..U+00FF */
+	unsigned short *bmp[256];     /* rest of the BMP, one page per high byte */
+	int additive;                 /* string width is the sum of its advances */
 } Fnt;
 
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
+#define FCACHESIZE 1024 /* codepoints resolved to a font, a power of two */
+
+typedef struct {
+	long cp;          /* -1 when the slot is free */
+	struct Fnt *font; /* NULL when no font covers cp */
+} Fentry;
+
 typedef struct {
 	unsigned int w, h;
 	Display *dpy;
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;  /* bound to drawable for the lifetime of the Drw */
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	Fentry fcache[FCACHESIZE];
+	unsigned int fcount;
 } Drw;
 
 /* Drawable abstraction */
@@ -1,16 +1,22 @@
 /* See LICENSE file for copyright and license details. */
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
-#include <Imlib2.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PREMULSIMD
+#endif
 
 #include "drw.h"
 #include "util.h"
 
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
+#define TEXT_SIZ    1024 /* bytes drw_text() draws from one font run */
 
 static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -61,19 +67,252 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+/* FNV-1a */
+static unsigned long
+strhash(const char *s)
+{
+	unsigned long h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+void
+drw_wcache_flush(Drw *drw)
+{
+	int i;
+
+	for (i = 0; i < WCACHESIZE; i++) {
+		free(drw->wcache[i].text);
+		drw->wcache[i] = (Wentry){ NULL, 0, NULL, 0, -1, i - 1, i + 1 };
+		drw->wbucket[i] = -1;
+	}
+	drw->wcache[WCACHESIZE - 1].next = -1;
+	drw->wmru = 0;
+	drw->wlru = WCACHESIZE - 1;
+}
+
+/* move entry i to the front of the LRU list */
+static void
+wcachetouch(Drw *drw, int i)
+{
+	Wentry *e = drw->wcache;
+
+	if (drw->wmru == i)
+		return;
+	e[e[i].prev].next = e[i].next;
+	if (e[i].next >= 0)
+		e[e[i].next].prev = e[i].prev;
+	else
+		drw->wlru = e[i].prev;
+	e[i].prev = -1;
+	e[i].next = drw->wmru;
+	e[drw->wmru].prev = i;
+	drw->wmru = i;
+}
+
+static void
+fcacheflush(Drw *drw)
+{
+	int i;
+
+	for (i = 0; i < FCACHESIZE; i++)
+		drw->fcache[i] = (Fentry){ -1, NULL };
+	drw->fcount = 0;
+}
+
+static Fentry *
+fcacheslot(Drw *drw, long u)
+{
+	unsigned int i = (unsigned long)u * 2654435761u & (FCACHESIZE - 1);
+
+	while (drw->fcache[i].cp != -1 && drw->fcache[i].cp != u)
+		i = (i + 1) & (FCACHESIZE - 1);
+	return &drw->fcache[i];
+}
+
+static void
+fcacheput(Drw *drw, long u, Fnt *font)
+{
+	Fentry *e;
+
+	if (drw->fcount >= FCACHESIZE / 4 * 3)
+		fcacheflush(drw);
+	if ((e = fcacheslot(drw, u))->cp == -1)
+		drw->fcount++;
+	e->cp = u;
+	e->font = font;
+}
+
+/* Font that draws u: the first loaded font covering it, or the primary font
+ * when no font on the system does. NULL until u has been resolved. */
+static Fnt *
+fontfor(Drw *drw, long u)
+{
+	Fentry *e;
+	Fnt *f;
+
+	if ((e = fcacheslot(drw, u))->cp == u)
+		return e->font ? e->font : drw->fonts;
+	for (f = drw->fonts; f; f = f->next)
+		if (XftCharExists(drw->dpy, f->xfont, u)) {
+			fcacheput(drw, u, f);
+			return f;
+		}
+	return NULL;
+}
+
+/* blocks whose fallback fonts are matched in the background at startup */
+static const struct {
+	long rep, lo, hi;
+} blocks[] = {
+	{ 0x03B1, 0x0370, 0x03FF }, /* Greek */
+	{ 0x0430, 0x0400, 0x04FF }, /* Cyrillic */
+	{ 0x05D0, 0x0590, 0x05FF }, /* Hebrew */
+	{ 0x0627, 0x0600, 0x06FF }, /* Arabic */
+	{ 0x0905, 0x0900, 0x097F }, /* Devanagari */
+	{ 0x0E01, 0x0E00, 0x0E7F }, /* Thai */
+	{ 0x2190, 0x2190, 0x21FF }, /* Arrows */
+	{ 0x2200, 0x2200, 0x22FF }, /* Mathematical Operators */
+	{ 0x2500, 0x2500, 0x259F }, /* Box Drawing, Block Elements */
+	{ 0x25A0, 0x25A0, 0x25FF }, /* Geometric Shapes */
+	{ 0x2600, 0x2600, 0x27BF }, /* Miscellaneous Symbols, Dingbats */
+	{ 0x2800, 0x2800, 0x28FF }, /* Braille */
+	{ 0x3042, 0x3000, 0x30FF }, /* CJK Symbols, Hiragana, Katakana */
+	{ 0x4E00, 0x4E00, 0x9FFF }, /* CJK Unified Ideographs */
+	{ 0xAC00, 0xAC00, 0xD7AF }, /* Hangul Syllables */
+	{ 0xE000, 0xE000, 0xF8FF }, /* Private Use Area, icon fonts */
+};
+
+#define NBLOCKS (sizeof(blocks) / sizeof(blocks[0]))
+
+struct Probe {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int done;
+	FcPattern *tmpl;
+	int want[NBLOCKS];
+	FcPattern *match[NBLOCKS];
+};
+
+static void *
+probethread(void *arg)
+{
+	struct Probe *p = arg;
+	FcCharSet *fccharset;
+	FcPattern *fcpattern;
+	FcResult result;
+	size_t i;
+
+	for (i = 0; i < NBLOCKS; i++) {
+		if (!p->want[i])
+			continue;
+		fccharset = FcCharSetCreate();
+		FcCharSetAddChar(fccharset, blocks[i].rep);
+		fcpattern = FcPatternDuplicate(p->tmpl);
+		FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+		FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+		FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
+		FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+		FcDefaultSubstitute(fcpattern);
+		p->match[i] = FcFontMatch(NULL, fcpattern, &result);
+		FcCharSetDestroy(fccharset);
+		FcPatternDestroy(fcpattern);
+	}
+	pthread_mutex_lock(&p->lock);
+	p->done = 1;
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* A copy of the probed match for u's block if that font covers u. NULL
+ * while the probe is still running, so the caller falls back to matching. */
+static FcPattern *
+probed(Drw *drw, long u)
+{
+	struct Probe *p = drw->probe;
+	FcCharSet *cs;
+	size_t i;
+	int done;
+
+	if (!p)
+		return NULL;
+	pthread_mutex_lock(&p->lock);
+	done = p->done;
+	pthread_mutex_unlock(&p->lock);
+	if (!done)
+		return NULL;
+	for (i = 0; i < NBLOCKS; i++)
+		if (BETWEEN(u, blocks[i].lo, blocks[i].hi) && p->match[i]
+		&& FcPatternGetCharSet(p->match[i], FC_CHARSET, 0, &cs) == FcResultMatch
+		&& FcCharSetHasChar(cs, u))
+			return FcPatternDuplicate(p->match[i]);
+	return NULL;
+}
+
+static void
+probefree(Drw *drw)
+{
+	struct Probe *p = drw->probe;
+	size_t i;
+
+	if (!p)
+		return;
+	pthread_join(p->thread, NULL);
+	for (i = 0; i < NBLOCKS; i++)
+		if (p->match[i])
+			FcPatternDestroy(p->match[i]);
+	FcPatternDestroy(p->tmpl);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+	drw->probe = NULL;
+}
+
+/* Match fallback fonts for the blocks the fontset does not cover on a
+ * separate thread, so drawing a title in them later only opens the font. */
+void
+drw_fontset_probe(Drw *drw)
+{
+	struct Probe *p;
+	size_t i, n = 0;
+
+	if (!drw || !drw->fonts || !drw->fonts->pattern)
+		return;
+	probefree(drw);
+	p = ecalloc(1, sizeof(struct Probe));
+	for (i = 0; i < NBLOCKS; i++)
+		n += p->want[i] = !fontfor(drw, blocks[i].rep);
+	if (!n) {
+		free(p);
+		return;
+	}
+	/* X resources are read here, the thread only talks to fontconfig */
+	p->tmpl = FcPatternDuplicate(drw->fonts->pattern);
+	XftDefaultSubstitute(drw->dpy, drw->screen, p->tmpl);
+	pthread_mutex_init(&p->lock, NULL);
+	if (pthread_create(&p->thread, NULL, probethread, p)) {
+		FcPatternDestroy(p->tmpl);
+		pthread_mutex_destroy(&p->lock);
+		free(p);
+		return;
+	}
+	drw->probe = p;
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h)
 {
 	Drw *drw = ecalloc(1, sizeof(Drw));
 
+	drw_wcache_flush(drw);
+	fcacheflush(drw);
 	drw->dpy = dpy;
 	drw->screen = screen;
 	drw->root = root;
-	drw->w = w;
-	drw->h = h;
-	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
-	drw->picture = XRenderCreatePicture(dpy, drw->drawable, XRenderFindVisualFormat(dpy, DefaultVisual(dpy, screen)), 0, NULL);
-	drw->gc = XCreateGC(dpy, root, 0, NULL);
+	drw->buf = drw->own = drw_buf_create(drw, w, h);
+	/* copies between pixmaps and bar windows never need GraphicsExpose */
+	drw->gc = XCreateGC(dpy, root, GCGraphicsExposures, &(XGCValues){ .graphics_exposures = False });
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
 
 	return drw;
@@ -82,28 +321,103 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 void
 drw_resize(Drw *drw, unsigned int w, unsigned int h)
 {
-	if (!drw)
-		return;
-
-	drw->w = w;
-	drw->h = h;
-	if (drw->picture)
-		XRenderFreePicture(drw->dpy, drw->picture);
-	if (drw->drawable)
-		XFreePixmap(drw->dpy, drw->drawable);
-	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
-	drw->picture = XRenderCreatePicture(drw->dpy, drw->drawable, XRenderFindVisualFormat(drw->dpy, DefaultVisual(drw->dpy, drw->screen)), 0, NULL);
+	if (drw)
+		drw_buf_resize(drw, drw->own, w, h);
 }
 
 void
 drw_free(Drw *drw)
 {
-	XRenderFreePicture(drw->dpy, drw->picture);
-	XFreePixmap(drw->dpy, drw->drawable);
+	probefree(drw);
+	drw_wcache_flush(drw);
+	drw_buf_free(drw, drw->own);
 	XFreeGC(drw->dpy, drw->gc);
 	free(drw);
 }
 
+Buf *
+drw_buf_create(Drw *drw, unsigned int w, unsigned int h)
+{
+	Buf *buf = ecalloc(1, sizeof(Buf));
+	Visual *visual = DefaultVisual(drw->dpy, drw->screen);
+
+	buf->w = w;
+	buf->h = h;
+	buf->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	buf->xftdraw = XftDrawCreate(drw->dpy, buf->drawable, visual,
+	                             DefaultColormap(drw->dpy, drw->screen));
+	buf->picture = XRenderCreatePicture(drw->dpy, buf->drawable, XRenderFindVisualFormat(drw->dpy, visual), 0, NULL);
+
+	return buf;
+}
+
+void
+drw_buf_resize(Drw *drw, Buf *buf, unsigned int w, unsigned int h)
+{
+	if (!buf || (buf->w == w && buf->h == h))
+		return;
+
+	buf->w = w;
+	buf->h = h;
+	XRenderFreePicture(drw->dpy, buf->picture);
+	XFreePixmap(drw->dpy, buf->drawable);
+	buf->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	XftDrawChange(buf->xftdraw, buf->drawable);
+	buf->picture = XRenderCreatePicture(drw->dpy, buf->drawable, XRenderFindVisualFormat(drw->dpy, DefaultVisual(drw->dpy, drw->screen)), 0, NULL);
+}
+
+void
+drw_buf_free(Drw *drw, Buf *buf)
+{
+	if (!buf)
+		return;
+	if (drw->buf == buf)
+		drw->buf = drw->own;
+	XRenderFreePicture(drw->dpy, buf->picture);
+	XftDrawDestroy(buf->xftdraw);
+	XFreePixmap(drw->dpy, buf->drawable);
+	free(buf);
+}
+
+/* advance of codepoint u in the BMP, asked from Xft only the first time */
+static unsigned int
+glyphadv(Fnt *font, long u)
+{
+	unsigned short *a;
+	XGlyphInfo ext;
+	FT_UInt g;
+
+	if (u < 256) {
+		a = &font->latin[u];
+	} else {
+		if (!font->bmp[u >> 8])
+			font->bmp[u >> 8] = ecalloc(256, sizeof(unsigned short));
+		a = &font->bmp[u >> 8][u & 0xFF];
+	}
+	if (!*a) {
+		g = XftCharIndex(font->dpy, font->xfont, u);
+		XftGlyphExtents(font->dpy, font->xfont, &g, 1, &ext);
+		*a = MAX(ext.xOff, 0) + 1;
+	}
+	return *a - 1;
+}
+
+/* Xft positions glyphs by their advances alone, so summing the table gives
+ * the same width as XftTextExtentsUtf8. Check it on kerning pairs anyway and
+ * let fonts that disagree fall back to Xft for every string. */
+static int
+isadditive(Fnt *font)
+{
+	static const char probe[] = "AVAWToTaYoLT";
+	XGlyphInfo ext;
+	unsigned int i, w = 0;
+
+	for (i = 0; probe[i]; i++)
+		w += glyphadv(font, probe[i]);
+	XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)probe, sizeof(probe) - 1, &ext);
+	return w == (unsigned int)ext.xOff;
+}
+
 /* This function is an implementation detail. Library users should use
  * drw_fontset_create instead.
  */
@@ -156,6 +470,7 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 	font->pattern = pattern;
 	font->h = xfont->ascent + xfont->descent;
 	font->dpy = drw->dpy;
+	font->additive = isadditive(font);
 
 	return font;
 }
@@ -163,8 +478,12 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 static void
 xfont_free(Fnt *font)
 {
+	size_t i;
+
 	if (!font)
 		return;
+	for (i = 0; i < 256; i++)
+		free(font->bmp[i]);
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
 	XftFontClose(font->dpy, font->xfont);
@@ -180,6 +499,9 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 	if (!drw || !fonts)
 		return NULL;
 
+	probefree(drw);
+	drw_wcache_flush(drw);
+	fcacheflush(drw);
 	for (i = 1; i <= fontcount; i++) {
 		if ((cur = xfont_create(drw, fonts[fontcount - i], NULL))) {
 			cur->next = ret;
@@ -230,8 +552,10 @@ drw_scm_create(Drw *drw, const char *clrnames[], size_t clrcount)
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
+	if (drw && drw->fonts != set) {
 		drw->fonts = set;
+		fcacheflush(drw);
+	}
 }
 
 void
@@ -241,6 +565,142 @@ drw_setscheme(Drw *drw, Clr *scm)
 		drw->scheme = scm;
 }
 
+/* draw into buf from now on, or into the Drw's own buffer when NULL */
+void
+drw_setbuf(Drw *drw, Buf *buf)
+{
+	if (drw)
+		drw->buf = buf ? buf : drw->own;
+}
+
+/* Premultiply ARGB32 pixels by their alpha as (c * a) >> 8, the SIMD
+ * kernels give the same bytes as the scalar one. */
+static void
+premulscalar(uint32_t *px, size_t n)
+{
+	uint32_t a, rb, g;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		a = px[i] >> 24;
+		rb = (a * (px[i] & 0xFF00FF)) >> 8;
+		g = (a * (px[i] & 0x00FF00)) >> 8;
+		px[i] = (rb & 0xFF00FF) | (g & 0x00FF00) | a << 24;
+	}
+}
+
+#ifdef PREMULSIMD
+__attribute__((target("sse2"))) static void
+premulsse2(uint32_t *px, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128(), amask = _mm_set1_epi32(0xFF000000);
+	__m128i p, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		p = _mm_loadu_si128((__m128i *)(px + i));
+		lo = _mm_unpacklo_epi8(p, zero);
+		hi = _mm_unpackhi_epi8(p, zero);
+		/* multiply every 16 bit channel by the alpha of its pixel */
+		lo = _mm_srli_epi16(_mm_mullo_epi16(lo, _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF)), 8);
+		hi = _mm_srli_epi16(_mm_mullo_epi16(hi, _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF)), 8);
+		p = _mm_or_si128(_mm_andnot_si128(amask, _mm_packus_epi16(lo, hi)), _mm_and_si128(p, amask));
+		_mm_storeu_si128((__m128i *)(px + i), p);
+	}
+	premulscalar(px + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+premulavx2(uint32_t *px, size_t n)
+{
+	const __m256i zero = _mm256_setzero_si256(), amask = _mm256_set1_epi32(0xFF000000);
+	__m256i p, lo, hi;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		p = _mm256_loadu_si256((__m256i *)(px + i));
+		lo = _mm256_unpacklo_epi8(p, zero);
+		hi = _mm256_unpackhi_epi8(p, zero);
+		lo = _mm256_srli_epi16(_mm256_mullo_epi16(lo, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, 0xFF), 0xFF)), 8);
+		hi = _mm256_srli_epi16(_mm256_mullo_epi16(hi, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, 0xFF), 0xFF)), 8);
+		p = _mm256_or_si256(_mm256_andnot_si256(amask, _mm256_packus_epi16(lo, hi)), _mm256_and_si256(p, amask));
+		_mm256_storeu_si256((__m256i *)(px + i), p);
+	}
+	premulscalar(px + i, n - i);
+}
+#endif /* PREMULSIMD */
+
+void
+drw_premultiply(uint32_t *px, size_t n)
+{
+	static void (*premul)(uint32_t *, size_t);
+
+	if (!premul) {
+		premul = premulscalar;
+#ifdef PREMULSIMD
+		if (__builtin_cpu_supports("avx2"))
+			premul = premulavx2;
+		else if (__builtin_cpu_supports("sse2"))
+			premul = premulsse2;
+#endif /* PREMULSIMD */
+	}
+	premul(px, n);
+}
+
+/* Scale src to dst by averaging the source area each destination pixel
+ * covers. In units where a source pixel is dw wide and a destination pixel
+ * sw wide, source column s spans [s * dw, (s + 1) * dw) and its weight in
+ * a destination column is the overlap; rows work the same. Every channel
+ * then sums to sw * sh times its average. Rows are summed with two channels
+ * in the 32 bit halves of a 64 bit word, which cannot carry over as a
+ * column sum stays below 256 * sw. */
+void
+drw_downscale(const uint32_t *src, unsigned int sw, unsigned int sh, uint32_t *dst, unsigned int dw, unsigned int dh)
+{
+	uint64_t *row, *acc, rb, ag, div = (uint64_t)sw * sh;
+	uint32_t p;
+	unsigned int x, y, s, t, c, lo, hi, m, e;
+
+	row = ecalloc((size_t)dw * 2, sizeof(uint64_t));
+	acc = ecalloc((size_t)dw * dh * 4, sizeof(uint64_t));
+	for (t = 0; t < sh; t++) {
+		/* source row t summed into dw columns, e is where column x ends */
+		memset(row, 0, (size_t)dw * 2 * sizeof(uint64_t));
+		for (s = 0, x = 0, e = sw; s < sw; s++) {
+			p = src[(size_t)t * sw + s];
+			rb = (p & 0xFF) | (uint64_t)(p & 0xFF0000) << 16;
+			ag = (p >> 8 & 0xFF) | (uint64_t)(p >> 24) << 32;
+			for (lo = s * dw, hi = lo + dw; lo < hi; lo = m) {
+				m = MIN(hi, e);
+				row[x * 2] += rb * (m - lo);
+				row[x * 2 + 1] += ag * (m - lo);
+				if (m == e) {
+					x++;
+					e += sw;
+				}
+			}
+		}
+		/* and into the destination rows it overlaps */
+		for (lo = t * dh, hi = lo + dh, y = lo / sh; lo < hi; y++, lo = e) {
+			e = MIN(hi, (y + 1) * sh);
+			for (x = 0; x < dw; x++) {
+				acc[((size_t)y * dw + x) * 4] += (row[x * 2] & 0xFFFFFFFF) * (e - lo);
+				acc[((size_t)y * dw + x) * 4 + 1] += (row[x * 2 + 1] & 0xFFFFFFFF) * (e - lo);
+				acc[((size_t)y * dw + x) * 4 + 2] += (row[x * 2] >> 32) * (e - lo);
+				acc[((size_t)y * dw + x) * 4 + 3] += (row[x * 2 + 1] >> 32) * (e - lo);
+			}
+		}
+	}
+	for (y = 0; y < dh; y++)
+		for (x = 0; x < dw; x++) {
+			for (p = 0, c = 0; c < 4; c++)
+				p |= (uint32_t)((acc[((size_t)y * dw + x) * 4 + c] + div / 2) / div) << 8 * c;
+			dst[(size_t)y * dw + x] = p;
+		}
+	free(row);
+	free(acc);
+}
+
 Picture
 drw_picture_create_resized(Drw *drw, char *src, unsigned int srcw, unsigned int srch, unsigned int dstw, unsigned int dsth) {
 	Pixmap pm;
@@ -271,18 +731,11 @@ drw_picture_create_resized(Drw *drw, char *src, unsigned int srcw, unsigned int
 		xf.matrix[2][0] = 0; xf.matrix[2][1] = 0; xf.matrix[2][2] = 65536;
 		XRenderSetPictureTransform(drw->dpy, pic, &xf);
 	} else {
-		Imlib_Image origin = imlib_create_image_using_data(srcw, srch, (DATA32 *)src);
-		if (!origin) return None;
-		imlib_context_set_image(origin);
-		imlib_image_set_has_alpha(1);
-		Imlib_Image scaled = imlib_create_cropped_scaled_image(0, 0, srcw, srch, dstw, dsth);
-		imlib_free_image_and_decache();
-		if (!scaled) return None;
-		imlib_context_set_image(scaled);
-		imlib_image_set_has_alpha(1);
+		uint32_t *scaled = ecalloc((size_t)dstw * dsth, sizeof(uint32_t));
+		drw_downscale((uint32_t *)src, srcw, srch, scaled, dstw, dsth);
 
 		XImage img = {
-		    dstw, dsth, 0, ZPixmap, (char *)imlib_image_get_data_for_reading_only(),
+		    dstw, dsth, 0, ZPixmap, (char *)scaled,
 		    ImageByteOrder(drw->dpy), BitmapUnit(drw->dpy), BitmapBitOrder(drw->dpy), 32,
 		    32, 0, 32,
 		    0, 0, 0
@@ -292,7 +745,7 @@ drw_picture_create_resized(Drw *drw, char *src, unsigned int srcw, unsigned int
 		pm = XCreatePixmap(drw->dpy, drw->root, dstw, dsth, 32);
 		gc = XCreateGC(drw->dpy, pm, 0, NULL);
 		XPutImage(drw->dpy, pm, gc, &img, 0, 0, 0, 0, dstw, dsth);
-		imlib_free_image_and_decache();
+		free(scaled);
 		XFreeGC(drw->dpy, gc);
 
 		pic = XRenderCreatePicture(drw->dpy, pm, XRenderFindStandardFormat(drw->dpy, PictStandardARGB32), 0, NULL);
@@ -309,28 +762,111 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		return;
 	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
 	if (filled)
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
+		XFillRectangle(drw->dpy, drw->buf->drawable, drw->gc, x, y, w, h);
 	else
-		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
+		XDrawRectangle(drw->dpy, drw->buf->drawable, drw->gc, x, y, w - 1, h - 1);
+}
+
+/* Look for a font covering u and append it to the fontset. Codepoints no font
+ * covers are remembered so fontconfig is not asked again on every redraw. */
+static void
+fallback(Drw *drw, long u)
+{
+	FcCharSet *fccharset;
+	FcPattern *fcpattern;
+	FcPattern *match;
+	XftResult result;
+	Fnt *usedfont, *curfont;
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+
+	if (!(match = probed(drw, u))) {
+		drw->fcmatches++;
+		fccharset = FcCharSetCreate();
+		FcCharSetAddChar(fccharset, u);
+
+		fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+		FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+		FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+		FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
+
+		FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+		FcDefaultSubstitute(fcpattern);
+		match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+
+		FcCharSetDestroy(fccharset);
+		FcPatternDestroy(fcpattern);
+	}
+
+	if (match) {
+		usedfont = xfont_create(drw, NULL, match);
+		if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, u)) {
+			for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
+				; /* NOP */
+			curfont->next = usedfont;
+			drw_wcache_flush(drw); /* widths may have used a replacement glyph */
+			fcacheput(drw, u, usedfont);
+			return;
+		}
+		xfont_free(usedfont);
+	}
+	/* Regardless of whether or not a fallback font is found, the
+	 * character must be drawn. */
+	fcacheput(drw, u, NULL);
+}
+
+/* Longest prefix of text, cut on a codepoint boundary, that is at most w
+ * wide. Binary search over the codepoint boundaries; for additive fonts the
+ * prefix widths are summed up front so each probe is a lookup. */
+static size_t
+fitprefix(Fnt *font, const char *text, size_t len, unsigned int w, unsigned int *ew)
+{
+	size_t off[TEXT_SIZ + 1], n, i, c, lo, hi, mid;
+	unsigned int sum[TEXT_SIZ + 1], x, cw;
+	long u;
+
+	for (n = 0, i = 0, x = 0; i < len && n < TEXT_SIZ; n++, i += c) {
+		if (!(c = utf8decode(text + i, &u, len - i)))
+			break;
+		off[n] = i;
+		sum[n] = x;
+		if (font->additive) {
+			drw_font_getexts(font, text + i, c, &cw, NULL);
+			x += cw;
+		}
+	}
+	off[n] = MIN(i, len);
+	sum[n] = x;
+
+	*ew = 0;
+	for (lo = 0, hi = n; lo < hi;) {
+		mid = (lo + hi + 1) / 2;
+		if (!font->additive)
+			drw_font_getexts(font, text, off[mid], &sum[mid], NULL);
+		if (sum[mid] <= w) {
+			lo = mid;
+			*ew = sum[mid];
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return off[lo];
 }
 
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
-	char buf[1024];
+	char buf[TEXT_SIZ];
 	int ty;
-	unsigned int ew;
-	XftDraw *d = NULL;
+	unsigned int ew, dw;
 	Fnt *usedfont, *curfont, *nextfont;
-	size_t i, len;
-	int utf8strlen, utf8charlen, render = x || y || w || h;
+	size_t len;
+	int utf8strlen, utf8charlen, cut = 0, render = x || y || w || h;
 	long utf8codepoint = 0;
 	const char *utf8str;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern;
-	FcPattern *match;
-	XftResult result;
-	int charexists = 0;
 
 	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
 		return 0;
@@ -339,10 +875,7 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		w = ~w;
 	} else {
 		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
+		XFillRectangle(drw->dpy, drw->buf->drawable, drw->gc, x, y, w, h);
 		x += lpad;
 		w -= lpad;
 	}
@@ -354,41 +887,42 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
-				}
-			}
-
-			if (!charexists || nextfont)
+			if (!(curfont = fontfor(drw, utf8codepoint)))
 				break;
-			else
-				charexists = 0;
+			if (curfont != usedfont) {
+				nextfont = curfont;
+				break;
+			}
+			utf8strlen += utf8charlen;
+			text += utf8charlen;
 		}
 
 		if (utf8strlen) {
 			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
+			len = utf8strlen;
+			if (ew <= w && len < sizeof(buf)) {
+				memcpy(buf, utf8str, len);
+			} else {
+				/* shorten text to what fits before an ellipsis, which ends the line */
+				cut = 1;
+				drw_font_getexts(usedfont, "...", 3, &dw, NULL);
+				len = dw < w ? fitprefix(usedfont, utf8str, MIN(len, sizeof(buf) - 4), w - dw, &ew) : 0;
+				if (len) {
+					memcpy(buf, utf8str, len);
+					memcpy(buf + len, "...", 3);
+					len += 3;
+					ew += dw;
+				} else {
+					len = fitprefix(usedfont, "...", 3, w, &ew);
+					memcpy(buf, "...", len);
+				}
+			}
 
 			if (len) {
-				memcpy(buf, utf8str, len);
 				buf[len] = '\0';
-				if (len < utf8strlen)
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
-
 				if (render) {
 					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
+					XftDrawStringUtf8(drw->buf->xftdraw, &drw->scheme[invert ? ColBg : ColFg],
 					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
 				}
 				x += ew;
@@ -396,51 +930,14 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 			}
 		}
 
-		if (!*text) {
+		if (cut || !*text) {
 			break;
 		} else if (nextfont) {
-			charexists = 0;
 			usedfont = nextfont;
 		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
-
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-			FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					usedfont = drw->fonts;
-				}
-			}
+			fallback(drw, utf8codepoint);
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
 
 	return x + (render ? w : 0);
 }
@@ -450,7 +947,15 @@ drw_pic(Drw *drw, int x, int y, unsigned int w, unsigned int h, Picture pic)
 {
 	if (!drw)
 		return;
-	XRenderComposite(drw->dpy, PictOpOver, pic, None, drw->picture, 0, 0, 0, 0, x, y, w, h);
+	XRenderComposite(drw->dpy, PictOpOver, pic, None, drw->buf->picture, 0, 0, 0, 0, x, y, w, h);
+}
+
+/* copy all of src into the current buffer at x, y */
+void
+drw_blit(Drw *drw, Buf *src, int x, int y)
+{
+	if (drw && src)
+		XCopyArea(drw->dpy, src->drawable, drw->buf->drawable, drw->gc, 0, 0, src->w, src->h, x, y);
 }
 
 void
@@ -459,29 +964,78 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 	if (!drw)
 		return;
 
-	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
+	XCopyArea(drw->dpy, drw->buf->drawable, win, drw->gc, x, y, w, h, x, y);
 }
 
 unsigned int
 drw_fontset_getwidth(Drw *drw, const char *text)
 {
+	unsigned long h;
+	unsigned int w;
+	size_t len;
+	Wentry *e = drw ? drw->wcache : NULL;
+	int i, *b;
+
 	if (!drw || !drw->fonts || !text)
 		return 0;
-	return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+	h = strhash(text);
+	for (i = drw->wbucket[h & (WCACHESIZE - 1)]; i >= 0; i = e[i].hnext)
+		if (e[i].hash == h && e[i].set == drw->fonts && !strcmp(e[i].text, text)) {
+			drw->whits++;
+			wcachetouch(drw, i);
+			return e[i].w;
+		}
+
+	drw->wmisses++;
+	w = drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+	/* reuse the least recently used entry */
+	i = drw->wlru;
+	if (e[i].text) {
+		for (b = &drw->wbucket[e[i].hash & (WCACHESIZE - 1)]; *b != i; b = &e[*b].hnext)
+			;
+		*b = e[i].hnext;
+		free(e[i].text);
+	}
+	len = strlen(text);
+	e[i].text = ecalloc(len + 1, 1);
+	memcpy(e[i].text, text, len);
+	e[i].set = drw->fonts;
+	e[i].hash = h;
+	e[i].w = w;
+	b = &drw->wbucket[h & (WCACHESIZE - 1)];
+	e[i].hnext = *b;
+	*b = i;
+	wcachetouch(drw, i);
+	return w;
 }
 
 void
 drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h)
 {
 	XGlyphInfo ext;
+	unsigned int i, n, sum = 0;
+	long u;
 
 	if (!font || !text)
 		return;
 
-	XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+	for (i = 0; font->additive && i < len; i += n) {
+		if ((unsigned char)text[i] < 0x80) {
+			sum += glyphadv(font, text[i]);
+			n = 1;
+			continue;
+		}
+		n = utf8decode(text + i, &u, len - i);
+		if (!n || u == UTF_INVALID || u > 0xFFFF)
+			break; /* leave malformed text and astral planes to Xft */
+		sum += glyphadv(font, u);
+	}
+	if (i < len) {
+		XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
+		sum = ext.xOff;
+	}
 	if (w)
-		*w = ext.xOff;
+		*w = sum;
 	if (h)
 		*h = font->h;
 }
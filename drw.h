@@ -10,21 +10,56 @@ typedef struct Fnt {
 	XftFont *xfont;
 	FcPattern *pattern;
 	struct Fnt *next;
+	/* glyph advances plus one, zero until first looked up */
+	unsigned short latin[256];    /* U+0000..U+00FF */
+	unsigned short *bmp[256];     /* rest of the BMP, one page per high byte */
+	int additive;                 /* string width is the sum of its advances */
 } Fnt;
 
 enum { ColFg, ColBg, ColBorder }; /* Clr scheme index */
 typedef XftColor Clr;
 
+#define WCACHESIZE 256 /* text widths remembered per Drw, a power of two */
+
+typedef struct {
+	const Fnt *set;   /* fontset the width was measured with */
+	unsigned long hash;
+	char *text;
+	unsigned int w;
+	int hnext;        /* next entry in the same bucket */
+	int prev, next;   /* LRU order, most recent first */
+} Wentry;
+
+#define FCACHESIZE 1024 /* codepoints resolved to a font, a power of two */
+
+typedef struct {
+	long cp;          /* -1 when the slot is free */
+	struct Fnt *font; /* NULL when no font covers cp */
+} Fentry;
+
 typedef struct {
 	unsigned int w, h;
+	Drawable drawable;
+	XftDraw *xftdraw;  /* bound to drawable for the lifetime of the Buf */
+	Picture picture;
+} Buf;
+
+typedef struct {
 	Display *dpy;
 	int screen;
 	Window root;
-	Drawable drawable;
-	Picture picture;
+	Buf *buf;          /* target of the drawing functions */
+	Buf *own;          /* buffer made by drw_create() */
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	Wentry wcache[WCACHESIZE];
+	int wbucket[WCACHESIZE], wmru, wlru;
+	unsigned long whits, wmisses;
+	Fentry fcache[FCACHESIZE];
+	unsigned int fcount;
+	unsigned long fcmatches;  /* fallback fonts matched in the draw path */
+	struct Probe *probe;
 } Drw;
 
 /* Drawable abstraction */
@@ -32,10 +67,17 @@ Drw *drw_create(Display *dpy, int screen, Window win, unsigned int w, unsigned i
 void drw_resize(Drw *drw, unsigned int w, unsigned int h);
 void drw_free(Drw *drw);
 
+/* Backing buffers */
+Buf *drw_buf_create(Drw *drw, unsigned int w, unsigned int h);
+void drw_buf_resize(Drw *drw, Buf *buf, unsigned int w, unsigned int h);
+void drw_buf_free(Drw *drw, Buf *buf);
+
 /* Fnt abstraction */
 Fnt *drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount);
 void drw_fontset_free(Fnt* set);
+void drw_fontset_probe(Drw *drw);
 unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
+void drw_wcache_flush(Drw *drw);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
 
 /* Colorscheme abstraction */
@@ -49,13 +91,18 @@ void drw_cur_free(Drw *drw, Cur *cursor);
 /* Drawing context manipulation */
 void drw_setfontset(Drw *drw, Fnt *set);
 void drw_setscheme(Drw *drw, Clr *scm);
+void drw_setbuf(Drw *drw, Buf *buf);
 
+/* Image functions */
+void drw_premultiply(uint32_t *px, size_t n);
+void drw_downscale(const uint32_t *src, unsigned int sw, unsigned int sh, uint32_t *dst, unsigned int dw, unsigned int dh);
 Picture drw_picture_create_resized(Drw *drw, char *src, unsigned int src_w, unsigned int src_h, unsigned int dst_w, unsigned int dst_h);
 
 /* Drawing functions */
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
 void drw_pic(Drw *drw, int x, int y, unsigned int w, unsigned int h, Picture pic);
+void drw_blit(Drw *drw, Buf *src, int x, int y);
 
 /* Map functions */
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
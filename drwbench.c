@@ -0,0 +1,208 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Microbenchmarks for the drw.c primitives the bar is drawn with. Needs an X
+ * server, a throwaway one is enough:
+ *
+ *   Xvfb :99 -screen 0 1920x1080x24 & DISPLAY=:99 ./drwbench [font ...]
+ *
+ * Every line reports the mean wall time per call, including the round trip
+ * that waits for the server to finish, and the X requests issued per call.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+#include <X11/extensions/Xrender.h>
+
+#include "drw.h"
+#include "util.h"
+
+#define LENGTH(X)  (sizeof X / sizeof X[0])
+#define CALLS      2000  /* calls per measurement */
+#define CELLW      300   /* width of a title cell */
+
+typedef struct {
+	const char *name;
+	const char **s;
+	size_t n;
+} Corpus;
+
+static const char *ascii[] = {
+	"st",
+	"vim drw.c",
+	"~/src/dwm - make bench",
+	"Inbox (3) - someone@example.org - Mail",
+	"The quick brown fox jumps over the lazy dog - Document Viewer",
+};
+static const char *urls[] = {
+	"https://www.example.org/search?q=dynamic+window+manager&source=hp&ei=8y2hYbq1E4Cl&iflsig=AHkkrS4AAAAA&oq=dynamic&gs_lcp=Cgdnd3Mtd2l6EAMyBQgAEIAE - Browser",
+	"https://code.example.com/suckless/dwm/commit/1b8e7e6ac6f8b8f7d2c1a4e2d6b0f3c9a8e7d6c5?diff=split&w=1#diff-5f8b0c3e2a1d9f7e6b4c3a2d1e0f9a8b - Browser",
+	"file:///home/user/Downloads/very/deeply/nested/directory/structure/with/a/long/name/report-2021-final-v3-reviewed.pdf",
+};
+static const char *cjk[] = {
+	"\xe6\x96\x87\xe5\xad\x97\xe5\x8c\x96\xe3\x81\x91 - \xe3\x83\x86\xe3\x82\xad\xe3\x82\xb9\xe3\x83\x88\xe3\x82\xa8\xe3\x83\x87\xe3\x82\xa3\xe3\x82\xbf",
+	"\xe4\xb8\xad\xe6\x96\x87\xe7\xbd\x91\xe9\xa1\xb5\xe6\xa0\x87\xe9\xa2\x98 \xe2\x80\x94 \xe6\xb5\x8f\xe8\xa7\x88\xe5\x99\xa8",
+	"\xed\x95\x9c\xea\xb5\xad\xec\x96\xb4 \xec\xa0\x9c\xeb\xaa\xa9 - \xeb\xac\xb8\xec\x84\x9c",
+};
+static const char *emoji[] = {
+	"\xf0\x9f\x8e\xb5 Now playing \xf0\x9f\x8e\xb6 \xf0\x9f\x94\x8a",
+	"\xf0\x9f\x94\xa5\xf0\x9f\x94\xa5 release \xf0\x9f\x9a\x80 shipped \xe2\x9c\x85 \xf0\x9f\x8e\x89\xf0\x9f\x8e\x89\xf0\x9f\x8e\x89",
+	"\xe2\x98\x80 21\xc2\xb0" "C \xe2\x9a\xa1 87% \xf0\x9f\x94\x8b \xf0\x9f\x93\xb6 \xe2\x8f\xb0 12:00",
+};
+static const Corpus corpora[] = {
+	{ "ascii", ascii, LENGTH(ascii) },
+	{ "url",   urls,  LENGTH(urls) },
+	{ "cjk",   cjk,   LENGTH(cjk) },
+	{ "emoji", emoji, LENGTH(emoji) },
+};
+static const unsigned int iconsizes[] = { 16, 32, 64, 128, 256, 512 };
+static const char *fonts[] = { "monospace:size=10" };
+static const char *colors[] = { "#bbbbbb", "#222222", "#444444" };
+
+static Display *dpy;
+static Drw *drw;
+static double t0;
+static unsigned long r0;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+start(void)
+{
+	XSync(dpy, False);
+	r0 = NextRequest(dpy);
+	t0 = now();
+}
+
+static void
+report(const char *what, const char *on, unsigned long calls)
+{
+	XSync(dpy, False); /* its GetInputFocus is not counted */
+	printf("%-26s %-8s %10.1f ns/call %8.2f requests/call\n", what, on,
+		(now() - t0) / calls, (double)(NextRequest(dpy) - r0 - 1) / calls);
+}
+
+static void
+benchtext(const Corpus *c, unsigned int bh)
+{
+	unsigned long i;
+
+	for (i = 0; i < c->n; i++) /* load fallback fonts up front */
+		drw_text(drw, 0, 0, CELLW, bh, 0, c->s[i], 0);
+
+	start();
+	for (i = 0; i < CALLS; i++) {
+		drw_wcache_flush(drw);
+		drw_fontset_getwidth(drw, c->s[i % c->n]);
+	}
+	report("drw_fontset_getwidth cold", c->name, CALLS);
+	start();
+	for (i = 0; i < CALLS; i++)
+		drw_fontset_getwidth(drw, c->s[i % c->n]);
+	report("drw_fontset_getwidth warm", c->name, CALLS);
+	start();
+	for (i = 0; i < CALLS; i++)
+		drw_text(drw, 0, 0, 0, 0, 0, c->s[i % c->n], 0);
+	report("drw_text measure", c->name, CALLS);
+	start();
+	for (i = 0; i < CALLS; i++)
+		drw_text(drw, 0, 0, CELLW, bh, bh / 2, c->s[i % c->n], i & 1);
+	report("drw_text render", c->name, CALLS);
+}
+
+static void
+benchicons(unsigned int bh)
+{
+	uint32_t *argb;
+	Picture pic;
+	char what[32];
+	unsigned int i, s, x, y;
+	unsigned long n;
+
+	for (i = 0; i < LENGTH(iconsizes); i++) {
+		s = iconsizes[i];
+		argb = ecalloc(s * s, sizeof(uint32_t));
+		for (y = 0; y < s; y++)
+			for (x = 0; x < s; x++)
+				argb[y * s + x] = 0xff000000 | (x * 255 / s) << 16 | (y * 255 / s) << 8 | 0x80;
+
+		start();
+		for (n = 0; n < CALLS / 10; n++)
+			XRenderFreePicture(dpy, drw_picture_create_resized(drw, (char *)argb, s, s, bh, bh));
+		snprintf(what, sizeof what, "create_resized %ux%u", s, s);
+		report(what, "icon", CALLS / 10);
+
+		pic = drw_picture_create_resized(drw, (char *)argb, s, s, bh, bh);
+		start();
+		for (n = 0; n < CALLS; n++)
+			drw_pic(drw, (n % 64) * bh, 0, bh, bh, pic);
+		snprintf(what, sizeof what, "drw_pic from %ux%u", s, s);
+		report(what, "icon", CALLS);
+		XRenderFreePicture(dpy, pic);
+		free(argb);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	Window win;
+	Clr *scm;
+	unsigned int bh, sw;
+	unsigned long i;
+	int screen;
+
+	if (!(dpy = XOpenDisplay(NULL)))
+		die("drwbench: cannot open display, start one with Xvfb");
+	screen = DefaultScreen(dpy);
+	sw = DisplayWidth(dpy, screen);
+	drw = drw_create(dpy, screen, RootWindow(dpy, screen), sw, 1);
+	if (!(argc > 1 ? drw_fontset_create(drw, (const char **)argv + 1, argc - 1)
+	               : drw_fontset_create(drw, fonts, LENGTH(fonts))))
+		die("drwbench: no fonts could be loaded");
+	bh = drw->fonts->h + 2;
+	drw_resize(drw, sw, bh);
+	scm = drw_scm_create(drw, colors, LENGTH(colors));
+	drw_setscheme(drw, scm);
+	win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen), 0, 0, sw, bh, 0, 0, 0);
+	XMapWindow(dpy, win);
+
+	for (i = 0; i < LENGTH(corpora); i++)
+		benchtext(&corpora[i], bh);
+
+	start();
+	for (i = 0; i < CALLS; i++)
+		drw_rect(drw, (i % 64) * bh, 0, bh, bh, 1, i & 1);
+	report("drw_rect filled", "-", CALLS);
+	start();
+	for (i = 0; i < CALLS; i++)
+		drw_rect(drw, (i % 64) * bh, 0, bh / 3, bh / 3, 0, i & 1);
+	report("drw_rect outline", "-", CALLS);
+
+	benchicons(bh);
+
+	start();
+	for (i = 0; i < CALLS; i++)
+		drw_map(drw, win, 0, 0, sw, bh);
+	report("drw_map full bar", "-", CALLS);
+	start();
+	for (i = 0; i < CALLS; i++)
+		drw_map(drw, win, (i % 16) * CELLW / 4, 0, CELLW / 4, bh);
+	report("drw_map one cell", "-", CALLS);
+
+	free(scm);
+	drw_fontset_free(drw->fonts);
+	drw_free(drw);
+	XDestroyWindow(dpy, win);
+	XCloseDisplay(dpy);
+	return EXIT_SUCCESS;
+}
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -39,12 +40,16 @@
 #include <X11/Xlib.h>
 #include <X11/Xproto.h>
 #include <X11/Xutil.h>
+#include <X11/Xlib-xcb.h>
 #ifdef XINERAMA
 #include <X11/extensions/Xinerama.h>
 #endif /* XINERAMA */
 #include <X11/Xft/Xft.h>
 
 #include "drw.h"
+#include "record.h"
+#include "stats.h"
+#include "trace.h"
 #include "util.h"
 
 /* macros */
@@ -59,6 +64,8 @@
 #define HEIGHT(X)               ((X)->h + 2 * (X)->bw)
 #define TAGMASK                 ((1 << LENGTH(tags)) - 1)
 #define TEXTW(X)                (drw_fontset_getwidth(drw, (X)) + lrpad)
+#define MANAGEPROPS             (((1 << PropLast) - 1) & ~(1 << PropState))
+#define ICONPREFIX              4096 /* longs of _NET_WM_ICON fetched up front */
 
 #define SYSTEM_TRAY_REQUEST_DOCK    0
 
@@ -87,6 +94,15 @@ enum { Manager, Xembed, XembedInfo, XLast }; /* Xembed atoms */
 enum { WMProtocols, WMDelete, WMState, WMTakeFocus, WMLast }; /* default atoms */
 enum { ClkTagBar, ClkLtSymbol, ClkStatusText, ClkWinTitle,
        ClkClientWin, ClkRootWin, ClkLast }; /* clicks */
+enum { WinClient, WinSystrayIcon, WinBar }; /* window index entries */
+enum { PropNetWMName, PropWMName, PropTransient, PropClass, PropWMState,
+       PropWindowType, PropNormalHints, PropHints, PropIcon, PropState,
+       PropLast }; /* prefetched properties */
+enum { DirtyLayout = 1 << 0, DirtyStack = 1 << 1, DirtyBar = 1 << 2,
+       DirtySystray = 1 << 3 }; /* deferred monitor work */
+enum { SegStatus, SegTag, SegLayout, SegTitle, SegFill }; /* bar segments */
+enum { SegSel = 1 << 0, SegUrg = 1 << 1, SegBox = 1 << 2,
+       SegFilled = 1 << 3 }; /* bar segment flags */
 
 typedef union {
 	int i;
@@ -114,7 +130,12 @@ struct Client {
 	int bw, oldbw;
 	unsigned int tags;
 	int isfixed, isfloating, isurgent, neverfocus, oldstate, isfullscreen;
+	int confpending;
 	unsigned int icw, ich; Picture icon;
+	unsigned long icongen; /* icon being loaded, 0 if none */
+	unsigned long iconused; /* when a bar last showed it */
+	int iconwant; /* load the icon when a bar shows it next */
+	int noicon; /* last seen without _NET_WM_ICON, loads get no placeholder */
 	Client *next;
 	Client *snext;
 	Monitor *mon;
@@ -134,6 +155,16 @@ typedef struct {
 	void (*arrange)(Monitor *);
 } Layout;
 
+typedef struct {
+	int type, x, w;
+	unsigned int flags;
+	const char *text;
+	unsigned int tag;     /* tag cells only, index into tags[] */
+	Client *c;            /* title cells only, valid while drawing */
+	unsigned long fp;     /* fingerprint of everything drawn */
+	int drawn;
+} Seg;
+
 typedef struct Pertag Pertag;
 struct Monitor {
 	char ltsymbol[16];
@@ -146,6 +177,7 @@ struct Monitor {
 	unsigned int seltags;
 	unsigned int sellt;
 	unsigned int tagset[2];
+	unsigned int dirty;   /* work left for the next commit() */
 	int showbar;
 	int topbar;
 	Client *clients;
@@ -153,6 +185,9 @@ struct Monitor {
 	Client *stack;
 	Monitor *next;
 	Window barwin;
+	Buf *bar;
+	Seg *seg;             /* bar segments as last drawn */
+	unsigned int nseg, segcap;
 	const Layout *lt[2];
 	Pertag *pertag;
 };
@@ -172,11 +207,48 @@ struct Systray {
 	Client *icons;
 };
 
+typedef struct Winref Winref;
+struct Winref {
+	Window win;
+	int type;
+	void *p;
+	Winref *next;
+};
+
+typedef struct {
+	xcb_get_property_cookie_t cookie[PropLast];
+	xcb_get_property_reply_t *reply[PropLast];
+	unsigned int mask; /* properties asked for */
+} Props;
+
+typedef struct Iconref Iconref;
+struct Iconref {
+	uint64_t key; /* hash of the source image and the size it is scaled to */
+	Picture pic;
+	unsigned int refs;
+	unsigned long bytes; /* server memory behind pic */
+	Iconref *next;
+};
+
+typedef struct Iconjob Iconjob;
+struct Iconjob {
+	Window win;
+	unsigned long gen;
+	xcb_get_property_reply_t *r; /* head of _NET_WM_ICON */
+	Picture icon;
+	unsigned int icw, ich;
+	/* what loading it cost, added to the counters by iconcount() */
+	unsigned long reads, bytes, hits, misses, saved, added;
+	uint64_t ns; /* spent in geticonprop(), 0 if it gave up early */
+	Iconjob *next;
+};
+
 /* function declarations */
-static void applyrules(Client *c);
+static void applyrules(Client *c, const char *class, const char *instance);
 static int applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact);
 static void arrange(Monitor *m);
 static void arrangemon(Monitor *m);
+static void arrangenow(Monitor *m);
 static void attach(Client *c);
 static void attachstack(Client *c);
 static void bstack(Monitor *m);
@@ -187,20 +259,26 @@ static void cleanupmon(Monitor *mon);
 static void clientmessage(XEvent *e);
 static void climit(const Arg *arg);
 static void cliuntag(const Arg *arg);
+static void commit(void);
+static void compressev(XEvent *ev);
 static void configure(Client *c);
 static void configurenotify(XEvent *e);
 static void configurerequest(XEvent *e);
 static Monitor *createmon(void);
+static int decodesizehints(xcb_get_property_reply_t *r, XSizeHints *size);
+static int decodewmhints(xcb_get_property_reply_t *r, XWMHints *wmh);
 static void destroynotify(XEvent *e);
 static void detach(Client *c);
 static void detachstack(Client *c);
 static Monitor *dirtomon(int dir);
 static void drawbar(Monitor *m);
+static void drawseg(Monitor *m, Seg *s);
 static void drawbars(void);
 static void enternotify(XEvent *e);
 static void enqueue(Client *c);
 static void enqueuestack(Client *c);
 static void expose(XEvent *e);
+static void flushgeom(Monitor *m);
 static void findwin(const Arg *arg);
 static void findwinontag(const Arg *arg);
 static void findcurwin(const Arg *arg);
@@ -209,18 +287,33 @@ static void focusin(XEvent *e);
 static void focusnth(const Arg *arg);
 static void focusmon(const Arg *arg);
 static void focusstack(const Arg *arg);
-static Picture geticonprop(Window w, unsigned int *icw, unsigned int *ich);
+static xcb_get_property_reply_t *geticonpart(xcb_connection_t *xc, Iconjob *j, uint32_t off, uint32_t len);
+static Picture geticonprop(xcb_connection_t *xc, Drw *dr, Iconjob *j);
 static Atom getatomprop(Client *c, Atom prop);
 static int getrootptr(int *x, int *y);
-static long getstate(Window w);
 static unsigned int getsystraywidth();
 static int gettextprop(Window w, Atom atom, char *text, unsigned int size);
 static void grabbuttons(Client *c, int focused);
 static void grabkeys(void);
+static void iconapply(Client *c, Iconjob *j);
+static void iconcollect(void);
+static void iconcount(Iconjob *j);
+static void iconload(xcb_connection_t *xc, Drw *d, Iconjob *j);
+static void iconqueue(Client *c);
+static Picture iconref(uint64_t key, Iconjob *j);
+static void iconrefadd(uint64_t key, Picture pic, unsigned long bytes);
+static int iconshared(Picture pic);
+static void iconstart(void);
+static void iconstop(void);
+static void icontrim(void);
+static void iconunref(Picture pic);
+static void iconuse(Client *c);
+static void *iconworker(void *arg);
 static void incnmaster(const Arg *arg);
 static void keypress(XEvent *e);
 static void killclient(const Arg *arg);
 static void manage(Window w, XWindowAttributes *wa);
+static void manageprops(Window w, XWindowAttributes *wa, Props *p);
 static void mappingnotify(XEvent *e);
 static void maprequest(XEvent *e);
 static void monocle(Monitor *m);
@@ -232,7 +325,12 @@ static Client *nexttiled(Client *c);
 static void pop(Client *);
 static void pullwin(const Arg *arg);
 static void prevwin(const Arg *arg);
+static uint32_t propcard(xcb_get_property_reply_t *r, Atom type);
 static void propertynotify(XEvent *e);
+static int proptext(xcb_get_property_reply_t *r, char *text, unsigned int size);
+static void propsfetch(Props *p, Window w, unsigned int mask);
+static void propsfree(Props *p);
+static void propsget(Props *p);
 static void quit(const Arg *arg);
 static Monitor *recttomon(int x, int y, int w, int h);
 static void removesystrayicon(Client *i);
@@ -250,6 +348,10 @@ static void scan(void);
 static int sendevent(Window w, Atom proto, int m, long d0, long d1, long d2, long d3, long d4);
 static void sendmon(Client *c, Monitor *m);
 static void setclientstate(Client *c, long state);
+static void setdirty(Monitor *m, unsigned int flags);
+static Seg *segadd(Monitor *m, int type, int x, int w, unsigned int flags, const char *text, Client *c);
+static int segdamaged(Monitor *m, unsigned int j);
+static void segflush(Monitor *m, int stw);
 static void setfocus(Client *c);
 static void setfullscreen(Client *c, int fullscreen);
 static void setlayout(const Arg *arg);
@@ -262,6 +364,9 @@ static void spawn(const Arg *arg);
 static Monitor *systraytomon(Monitor *m);
 static void tag(const Arg *arg);
 static void tagmon(const Arg *arg);
+static Buf *tagsprite(unsigned int i, unsigned int flags, int w);
+static void freetagsprites(unsigned int i);
+static int textprop(XTextProperty *name, char *text, unsigned int size);
 static void tile(Monitor *);
 static void grid(Monitor *);
 static void togglebar(const Arg *arg);
@@ -277,6 +382,9 @@ static void updatebars(void);
 static void updateclientlist(void);
 static int updategeom(void);
 static void updatenumlockmask(void);
+static void setsizehints(Client *c, XSizeHints *size);
+static void setwindowtype(Client *c, Atom state, Atom wtype);
+static void setwmhints(Client *c, XWMHints *wmh);
 static void updatesizehints(Client *c);
 static void updatestatus(void);
 static void updatesystray(void);
@@ -287,6 +395,9 @@ static void updateicon(Client *c);
 static void updatewindowtype(Client *c);
 static void updatewmhints(Client *c);
 static void view(const Arg *arg);
+static void winmapadd(Window w, int type, void *p);
+static void winmapdel(Window w, int type);
+static void *winmapget(Window w, int type);
 static Client *wintoclient(Window w);
 static Monitor *wintomon(Window w);
 static Client *wintosystrayicon(Window w);
@@ -324,15 +435,70 @@ static void (*handler[LASTEvent]) (XEvent *) = {
 	[ResizeRequest] = resizerequest,
 	[UnmapNotify] = unmapnotify
 };
+static const char *evname[LASTEvent] = {
+	[ButtonPress] = "ButtonPress",
+	[ClientMessage] = "ClientMessage",
+	[ConfigureRequest] = "ConfigureRequest",
+	[ConfigureNotify] = "ConfigureNotify",
+	[DestroyNotify] = "DestroyNotify",
+	[EnterNotify] = "EnterNotify",
+	[Expose] = "Expose",
+	[FocusIn] = "FocusIn",
+	[KeyPress] = "KeyPress",
+	[MappingNotify] = "MappingNotify",
+	[MapRequest] = "MapRequest",
+	[MotionNotify] = "MotionNotify",
+	[PropertyNotify] = "PropertyNotify",
+	[ResizeRequest] = "ResizeRequest",
+	[UnmapNotify] = "UnmapNotify"
+};
 static Atom wmatom[WMLast], netatom[NetLast], xatom[XLast];
 static int running = 1;
 static Cur *cursor[CurLast];
 static Clr **scheme;
 static Display *dpy;
+static xcb_connection_t *xcon; /* dpy's connection, for pipelined requests */
 static Drw *drw;
 static Monitor *mons, *selmon;
 static Window root, wmcheckwin;
 static int restart = 0;
+static int batching = 0;     /* collect client geometry instead of sending it */
+static const char *dirtyname[] = { "arrange", "restack", "drawbar", "systray" };
+static unsigned long dirtyreq[LENGTH(dirtyname)];  /* work asked for by handlers */
+static unsigned long dirtydone[LENGTH(dirtyname)]; /* work done by commit() */
+static unsigned long evcount[LASTEvent];      /* events read from the server */
+static unsigned long evcompressed[LASTEvent]; /* events folded into a later one */
+static Hist evhist[LASTEvent]; /* handler latency per event type */
+static Hist arrangehist, restackhist, drawbarhist, managehist, unmanagehist;
+static Hist iconhist, slayouthist;
+static unsigned long nrequests; /* X requests issued so far */
+static unsigned long exposeblits; /* exposes served from a retained bar */
+static unsigned long segdrawn, segkept; /* bar segments rendered and left */
+static unsigned long iconreads, iconbytes; /* _NET_WM_ICON replies and their size */
+static Hist barpixelhist; /* pixels rendered per drawbar() */
+static Seg *segs;        /* segments of the bar being drawn */
+static unsigned int nsegs, segscap;
+static Winref **winmap;      /* window -> client/systray icon/monitor index */
+static unsigned int winmapbits, winmapn;
+/* icons are fetched, scaled and uploaded by iconworker() on a connection of
+ * its own, finished jobs are announced with an IconReady message */
+static Display *icondpy;
+static Drw *icondrw;
+static pthread_t iconthread;
+static pthread_mutex_t iconlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t iconwake = PTHREAD_COND_INITIALIZER;
+static Iconjob *icontodo, **icontail = &icontodo, *icondone;
+static int iconquit;
+static unsigned long iconseq;
+static Atom iconready;
+/* Pictures shared by every client showing the same icon, looked up by the
+ * worker and released by the main thread. The counters are the main
+ * thread's, see iconcount(). */
+static Iconref *iconrefs;
+static pthread_mutex_t iconreflock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long iconhits, iconmisses, iconsaved; /* bytes not uploaded */
+static unsigned long iconresident; /* bytes behind collected iconrefs */
+static unsigned long iconclock, iconevicted;
 
 /*=== s_layout ===*/
 #include "s_layout.c"
@@ -351,31 +517,26 @@ struct Pertag {
    Client *prevwin;
 };
 
-#define DEBUG(...) { \
-   FILE *DBGfd = fopen("/tmp/dwm.log", "a"); \
-   fprintf(DBGfd, __VA_ARGS__); \
-   fclose(DBGfd); \
-}
-
 /* compile-time check if all tags fit into an unsigned int bit array. */
 struct NumTags { char limitexceeded[LENGTH(tags) > 31 ? -1 : 1]; };
 
+/* tag cells rendered once per label and SegSel/SegUrg/SegBox/SegFilled state */
+static Buf *tagsprites[LENGTH(tags)][16];
+static unsigned long tagsprited; /* tag cells rendered from text */
+
 /* function implementations */
 void
-applyrules(Client *c)
+applyrules(Client *c, const char *class, const char *instance)
 {
-	const char *class, *instance;
 	unsigned int i;
 	const Rule *r;
 	Monitor *m;
-	XClassHint ch = { NULL, NULL };
 
 	/* rule matching */
 	c->isfloating = 0;
 	c->tags = 0;
-	XGetClassHint(dpy, c->win, &ch);
-	class    = ch.res_class ? ch.res_class : broken;
-	instance = ch.res_name  ? ch.res_name  : broken;
+	class    = class    ? class    : broken;
+	instance = instance ? instance : broken;
 
 	for (i = 0; i < LENGTH(rules); i++) {
 		r = &rules[i];
@@ -390,10 +551,6 @@ applyrules(Client *c)
 				c->mon = m;
 		}
 	}
-	if (ch.res_class)
-		XFree(ch.res_class);
-	if (ch.res_name)
-		XFree(ch.res_name);
 	c->tags = c->tags & TAGMASK ? c->tags & TAGMASK : c->mon->tagset[c->mon->seltags];
 }
 
@@ -466,15 +623,7 @@ applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact)
 void
 arrange(Monitor *m)
 {
-	if (m)
-		showhide(m->stack);
-	else for (m = mons; m; m = m->next)
-		showhide(m->stack);
-	if (m) {
-		arrangemon(m);
-		restack(m);
-	} else for (m = mons; m; m = m->next)
-		arrangemon(m);
+	setdirty(m, m ? DirtyLayout|DirtyStack : DirtyLayout);
 }
 
 void
@@ -485,6 +634,23 @@ arrangemon(Monitor *m)
 		m->lt[m->sellt]->arrange(m);
 }
 
+/* lay out m at once instead of in the next commit() */
+void
+arrangenow(Monitor *m)
+{
+	uint64_t t0 = statnow();
+
+	dirtydone[0]++;
+	showhide(m->stack);
+	/* layouts only record the new geometry, it is sent in one go */
+	batching = 1;
+	arrangemon(m);
+	batching = 0;
+	flushgeom(m);
+	m->dirty &= ~DirtyLayout;
+	stathist(&arrangehist, t0);
+}
+
 void
 attach(Client *c)
 {
@@ -563,7 +729,7 @@ buttonpress(XEvent *e)
 			click = ClkWinTitle;
 	} else if ((c = wintoclient(ev->window))) {
 		focus(c);
-		restack(selmon);
+		setdirty(selmon, DirtyStack);
 		XAllowEvents(dpy, ReplayPointer, CurrentTime);
 		click = ClkClientWin;
 	}
@@ -591,12 +757,15 @@ cleanup(void)
 	Layout foo = { "", NULL };
 	Monitor *m;
 	size_t i;
+	const int evstat[] = { PropertyNotify, MotionNotify };
 
 	view(&a);
+	commit(); /* bring every client on screen before letting go of it */
 	selmon->lt[selmon->sellt] = &foo;
 	for (m = mons; m; m = m->next)
 		while (m->stack)
 			unmanage(m->stack, 0);
+	iconstop();
 	XUngrabKey(dpy, AnyKey, AnyModifier, root);
 	while (mons)
 		cleanupmon(mons);
@@ -609,8 +778,18 @@ cleanup(void)
 		drw_cur_free(drw, cursor[i]);
 	for (i = 0; i < LENGTH(colors); i++)
 		free(scheme[i]);
+	for (i = 0; i < LENGTH(tags); i++)
+		freetagsprites(i);
 	XDestroyWindow(dpy, wmcheckwin);
+	free(winmap);
 	drw_free(drw);
+	for (i = 0; i < LENGTH(dirtyname); i++)
+		fprintf(stderr, "dwm: %s: %lu requested, %lu done, %lu avoided\n",
+			dirtyname[i], dirtyreq[i], dirtydone[i], dirtyreq[i] - dirtydone[i]);
+	for (i = 0; i < LENGTH(evstat); i++)
+		fprintf(stderr, "dwm: %s: %lu received, %lu compressed (%.1f%%)\n",
+			evname[evstat[i]], evcount[evstat[i]], evcompressed[evstat[i]],
+			evcount[evstat[i]] ? 100.0 * evcompressed[evstat[i]] / evcount[evstat[i]] : 0.0);
 	XSync(dpy, False);
 	XSetInputFocus(dpy, PointerRoot, RevertToPointerRoot, CurrentTime);
 	XDeleteProperty(dpy, root, netatom[NetActiveWindow]);
@@ -627,8 +806,11 @@ cleanupmon(Monitor *mon)
 		for (m = mons; m && m->next != mon; m = m->next);
 		m->next = mon->next;
 	}
+	winmapdel(mon->barwin, WinBar);
 	XUnmapWindow(dpy, mon->barwin);
 	XDestroyWindow(dpy, mon->barwin);
+	drw_buf_free(drw, mon->bar);
+	free(mon->seg);
 	free(mon);
 }
 
@@ -640,6 +822,10 @@ clientmessage(XEvent *e)
 	XClientMessageEvent *cme = &e->xclient;
 	Client *c = wintoclient(cme->window);
 
+	if (cme->window == wmcheckwin && cme->message_type == iconready) {
+		iconcollect();
+		return;
+	}
 	if (showsystray && cme->window == systray->win && cme->message_type == netatom[NetSystemTrayOP]) {
 		/* add systray icons */
 		if (cme->data.l[1] == SYSTEM_TRAY_REQUEST_DOCK) {
@@ -652,6 +838,7 @@ clientmessage(XEvent *e)
 			c->mon = selmon;
 			c->next = systray->icons;
 			systray->icons = c;
+			winmapadd(c->win, WinSystrayIcon, c);
 			XGetWindowAttributes(dpy, c->win, &wa);
 			c->x = c->oldx = c->y = c->oldy = 0;
 			c->w = c->oldw = wa.width;
@@ -676,7 +863,7 @@ clientmessage(XEvent *e)
 			sendevent(c->win, netatom[Xembed], StructureNotifyMask, CurrentTime, XEMBED_MODALITY_ON, 0 , systray->win, XEMBED_EMBEDDED_VERSION);
 			XSync(dpy, False);
 			resizebarwin(selmon);
-			updatesystray();
+			setdirty(selmon, DirtySystray);
 			setclientstate(c, NormalState);
 		}
 		return;
@@ -716,6 +903,80 @@ cliuntag(const Arg *arg)
    arrange(selmon);
 }
 
+/* do the arranging and drawing handlers asked for since the last call */
+void
+commit(void)
+{
+	Monitor *m;
+	unsigned int systray = 0;
+	uint64_t t0;
+
+	for (m = mons; m; m = m->next) {
+		if (m->dirty)
+			TRACE(TraceCommit, m->num, m->dirty, 0, 0, 0);
+		if (m->dirty & DirtyLayout)
+			arrangenow(m);
+		if (m->dirty & DirtyStack) {
+			dirtydone[1]++;
+			t0 = statnow();
+			restack(m);
+			stathist(&restackhist, t0);
+		}
+		if (m->dirty & DirtyBar) {
+			dirtydone[2]++;
+			drawbar(m);
+		}
+		systray |= m->dirty & DirtySystray;
+		m->dirty = 0;
+	}
+	if (systray) {
+		dirtydone[3]++;
+		updatesystray();
+	}
+}
+
+static int
+samekey(XEvent *ev, XEvent *e)
+{
+	if (ev->type != e->type)
+		return 0;
+	switch (ev->type) {
+	case PropertyNotify:
+		return ev->xproperty.window == e->xproperty.window
+		&& ev->xproperty.atom == e->xproperty.atom
+		&& ev->xproperty.state == e->xproperty.state;
+	case MotionNotify:
+		return ev->xmotion.window == e->xmotion.window;
+	}
+	return 0;
+}
+
+/* Replace ev by the last of the events with the same key queued right behind
+ * it. PropertyNotify handlers refetch the current value and motion only
+ * cares about the latest position, so the ones in between would repeat the
+ * same work. Events are never taken from behind others, which keeps them in
+ * order with clicks, crossings and requests. */
+void
+compressev(XEvent *ev)
+{
+	XEvent next;
+
+	evcount[ev->type]++;
+	recevent(dpy, ev);
+	if (ev->type != PropertyNotify && ev->type != MotionNotify)
+		return;
+	while (XEventsQueued(dpy, QueuedAfterReading)) {
+		XPeekEvent(dpy, &next);
+		if (!samekey(&next, ev))
+			break;
+		XNextEvent(dpy, &next);
+		evcount[ev->type]++;
+		evcompressed[ev->type]++;
+		recevent(dpy, &next);
+		*ev = next;
+	}
+}
+
 void
 configure(Client *c)
 {
@@ -749,7 +1010,6 @@ configurenotify(XEvent *e)
 		sw = ev->width;
 		sh = ev->height;
 		if (updategeom() || dirty) {
-			drw_resize(drw, sw, bh);
 			updatebars();
 			for (m = mons; m; m = m->next) {
 				for (c = m->clients; c; c = c->next)
@@ -812,7 +1072,6 @@ configurerequest(XEvent *e)
 		wc.stack_mode = ev->detail;
 		XConfigureWindow(dpy, ev->window, ev->value_mask, &wc);
 	}
-	XSync(dpy, False);
 }
 
 Monitor *
@@ -849,6 +1108,60 @@ createmon(void)
 	return m;
 }
 
+/* WM_NORMAL_HINTS as XGetWMNormalHints() would return it */
+int
+decodesizehints(xcb_get_property_reply_t *r, XSizeHints *size)
+{
+	uint32_t *v;
+	int n;
+
+	if (!r || r->type != XA_WM_SIZE_HINTS || r->format != 32
+	|| (n = xcb_get_property_value_length(r) / 4) < 15)
+		return 0;
+	v = xcb_get_property_value(r);
+	size->flags = v[0];
+	size->x = v[1]; size->y = v[2];
+	size->width = v[3]; size->height = v[4];
+	size->min_width = v[5]; size->min_height = v[6];
+	size->max_width = v[7]; size->max_height = v[8];
+	size->width_inc = v[9]; size->height_inc = v[10];
+	size->min_aspect.x = v[11]; size->min_aspect.y = v[12];
+	size->max_aspect.x = v[13]; size->max_aspect.y = v[14];
+	if (n < 18) { /* pre-ICCCM hints */
+		size->flags &= ~(PBaseSize|PWinGravity);
+		size->base_width = size->base_height = 0;
+		size->win_gravity = NorthWestGravity;
+	} else {
+		size->base_width = v[15]; size->base_height = v[16];
+		size->win_gravity = v[17];
+	}
+	return 1;
+}
+
+/* WM_HINTS as XGetWMHints() would return it */
+int
+decodewmhints(xcb_get_property_reply_t *r, XWMHints *wmh)
+{
+	uint32_t *v;
+	int n;
+
+	if (!r || r->type != XA_WM_HINTS || r->format != 32
+	|| (n = xcb_get_property_value_length(r) / 4) < 8)
+		return 0;
+	v = xcb_get_property_value(r);
+	wmh->flags = v[0];
+	wmh->input = v[1] ? True : False;
+	wmh->initial_state = v[2];
+	wmh->icon_pixmap = v[3];
+	wmh->icon_window = v[4];
+	wmh->icon_x = v[5]; wmh->icon_y = v[6];
+	wmh->icon_mask = v[7];
+	if (n < 9)
+		wmh->flags &= ~WindowGroupHint;
+	wmh->window_group = n < 9 ? 0 : v[8];
+	return 1;
+}
+
 void
 destroynotify(XEvent *e)
 {
@@ -860,7 +1173,7 @@ destroynotify(XEvent *e)
 	else if ((c = wintosystrayicon(ev->window))) {
 		removesystrayicon(c);
 		resizebarwin(selmon);
-		updatesystray();
+		setdirty(selmon, DirtySystray);
 	}
 }
 
@@ -906,25 +1219,30 @@ void
 drawbar(Monitor *m)
 {
 	int x, w, sw = 0, stw = 0, tw, mw, ew = 0;
-	int boxs = drw->fonts->h / 9;
-	int boxw = drw->fonts->h / 6 + 2;
-	unsigned int i, occ = 0, urg = 0, n = 0;
+	unsigned int i, occ = 0, urg = 0, n = 0, flags;
 	Client *c;
+	uint64_t t0 = statnow();
 
 	if(showsystray && m == systraytomon(m))
 		stw = getsystraywidth();
 
-	/* draw status first so it can be overdrawn by tags later */
-	if (m == selmon) { /* status is only drawn on selected monitor */
-		drw_setscheme(drw, scheme[SchemeNorm]);
+	if (!m->bar)
+		m->bar = drw_buf_create(drw, m->ww, bh);
+	drw_setbuf(drw, m->bar);
+	nsegs = 0;
+
+	/* status comes first so it can be overdrawn by tags later, it is only
+	 * drawn on the selected monitor */
+	if (m == selmon)
 		sw = TEXTW(stext) - lrpad / 2 + 2; /* 2px right padding */
-		drw_text(drw, m->ww - sw - stw, 0, sw, bh, lrpad / 2 - 2, stext, 0);
-	}
+	segadd(m, SegStatus, m->ww - sw - stw, sw, 0, m == selmon ? stext : "", NULL);
 
 	resizebarwin(m);
 	for (c = m->clients; c; c = c->next) {
-		if (ISVISIBLE(c))
+		if (ISVISIBLE(c)) {
 			n++;
+			iconuse(c);
+		}
 		occ |= c->tags;
 		if (c->isurgent)
 			urg |= c->tags;
@@ -932,28 +1250,26 @@ drawbar(Monitor *m)
 	x = 0;
 	for (i = 0; i < LENGTH(tags); i++) {
 		w = TEXTW(tags[i]);
-		drw_setscheme(drw, scheme[m->tagset[m->seltags] & 1 << i ? SchemeSel : SchemeNorm]);
-		drw_text(drw, x, 0, w, bh, lrpad / 2, tags[i], urg & 1 << i);
+		flags = (m->tagset[m->seltags] & 1 << i ? SegSel : 0) | (urg & 1 << i ? SegUrg : 0);
 		if (occ & 1 << i)
-			drw_rect(drw, x + boxs, boxs, boxw, boxw,
-				m == selmon && selmon->sel && selmon->sel->tags & 1 << i,
-				urg & 1 << i);
+			flags |= SegBox | (m == selmon && selmon->sel && selmon->sel->tags & 1 << i ? SegFilled : 0);
+		segadd(m, SegTag, x, w, flags, tags[i], NULL)->tag = i;
 		x += w;
 	}
 	w = blw = TEXTW(m->ltsymbol);
-	drw_setscheme(drw, scheme[SchemeNorm]);
-	x = drw_text(drw, x, 0, w, bh, lrpad / 2, m->ltsymbol, 0);
+	segadd(m, SegLayout, x, w, 0, m->ltsymbol, NULL);
+	x += w;
 
 	if ((w = m->ww - sw - stw - x) > bh) {
 		if (n > 0) {
-			tw = MIN(32, TEXTW(m->sel->name) + lrpad + (m->sel->icon ? m->sel->icw + ICONSPACING : 0));
+			tw = MIN(32, TEXTW(m->sel->name) + lrpad + (m->sel->icw ? m->sel->icw + ICONSPACING : 0));
 			mw = (tw >= w || n == 1) ? 0 : (w - tw) / (n - 1);
 
 			i = 0;
 			for (c = m->clients; c; c = c->next) {
 				if (!ISVISIBLE(c) || c == m->sel)
 					continue;
-				tw = TEXTW(c->name) + (c->icon ? c->icw + ICONSPACING : 0);
+				tw = TEXTW(c->name) + (c->icw ? c->icw + ICONSPACING : 0);
 				if(tw < mw)
 					ew += (mw - tw);
 				else
@@ -965,31 +1281,58 @@ drawbar(Monitor *m)
 			for (c = m->clients; c; c = c->next) {
 				if (!ISVISIBLE(c))
 					continue;
-            tw = MIN(300, MIN(m->sel == c ? w : mw, TEXTW(c->name) + (c->icon ? c->icw + ICONSPACING : 0)));
-
-				drw_setscheme(drw, scheme[m->sel == c ? SchemeSel : SchemeNorm]);
-				if (tw > 0) /* trap special handling of 0 in drw_text */
-					drw_text(drw, x, 0, tw, bh, lrpad / 2 + (c->icon ? c->icw + ICONSPACING : 0), c->name, 0);
-            if (c->icon) drw_pic(drw, x + lrpad / 2, (bh - m->sel->ich) / 2, m->sel->icw, m->sel->ich, c->icon);
-				if (c->isfloating)
-					drw_rect(drw, x + boxs, boxs, boxw, boxw, c->isfixed, 0);
+            tw = MIN(300, MIN(m->sel == c ? w : mw, TEXTW(c->name) + (c->icw ? c->icw + ICONSPACING : 0)));
+
+				flags = (m->sel == c ? SegSel : 0) | (c->isfloating ? SegBox : 0) | (c->isfixed ? SegFilled : 0);
+				segadd(m, SegTitle, x, tw, flags, c->name, c);
 				x += tw;
 				w -= tw;
 			}
 		}
-		drw_setscheme(drw, scheme[SchemeNorm]);
-		drw_rect(drw, x, 0, w, bh, 1, 1);
+		segadd(m, SegFill, x, w, 0, "", NULL);
 	}
-	drw_map(drw, m->barwin, 0, 0, m->ww - stw, bh);
+	segflush(m, stw);
+	stathist(&drawbarhist, t0);
 }
 
 void
-drawbars(void)
+drawseg(Monitor *m, Seg *s)
 {
-	Monitor *m;
+	int boxs = drw->fonts->h / 9;
+	int boxw = drw->fonts->h / 6 + 2;
+	Client *c = s->c;
+
+	drw_setscheme(drw, scheme[s->flags & SegSel ? SchemeSel : SchemeNorm]);
+	switch (s->type) {
+	case SegStatus:
+		drw_text(drw, s->x, 0, s->w, bh, lrpad / 2 - 2, s->text, 0);
+		break;
+	case SegTag:
+		drw_blit(drw, tagsprite(s->tag, s->flags, s->w), s->x, 0);
+		break;
+	case SegLayout:
+		drw_text(drw, s->x, 0, s->w, bh, lrpad / 2, s->text, 0);
+		break;
+	case SegTitle:
+		if (s->w > 0) /* trap special handling of 0 in drw_text */
+			drw_text(drw, s->x, 0, s->w, bh, lrpad / 2 + (c->icw ? c->icw + ICONSPACING : 0), s->text, 0);
+		if (c->icon)
+			drw_pic(drw, s->x + lrpad / 2, (bh - c->ich) / 2, c->icw, c->ich, c->icon);
+		else if (c->icw) /* placeholder while the icon loads */
+			drw_rect(drw, s->x + lrpad / 2, (bh - c->ich) / 2, c->icw, c->ich, 0, 0);
+		if (s->flags & SegBox)
+			drw_rect(drw, s->x + boxs, boxs, boxw, boxw, s->flags & SegFilled, 0);
+		break;
+	case SegFill:
+		drw_rect(drw, s->x, 0, s->w, bh, 1, 1);
+		break;
+	}
+}
 
-	for (m = mons; m; m = m->next)
-		drawbar(m);
+void
+drawbars(void)
+{
+	setdirty(NULL, DirtyBar);
 }
 
 void
@@ -1039,10 +1382,35 @@ expose(XEvent *e)
 	Monitor *m;
 	XExposeEvent *ev = &e->xexpose;
 
-	if (ev->count == 0 && (m = wintomon(ev->window))) {
-		drawbar(m);
-		if (m == selmon)
-			updatesystray();
+	/* the systray is repainted by the server from its background pixel */
+	if (!(m = winmapget(ev->window, WinBar)))
+		return;
+	if (m->bar && !(m->dirty & DirtyBar)) {
+		/* nothing changed since the last drawbar(), copy the damage back */
+		drw_setbuf(drw, m->bar);
+		drw_map(drw, m->barwin, ev->x, ev->y, ev->width, ev->height);
+		exposeblits++;
+	} else if (ev->count == 0) {
+		setdirty(m, DirtyBar);
+	}
+}
+
+void
+flushgeom(Monitor *m)
+{
+	Client *c;
+	XWindowChanges wc;
+
+	for (c = m->clients; c; c = c->next) {
+		if (!c->confpending)
+			continue;
+		c->confpending = 0;
+		wc.x = c->x;
+		wc.y = c->y;
+		wc.width = c->w;
+		wc.height = c->h;
+		wc.border_width = c->bw;
+		XConfigureWindow(dpy, c->win, CWX|CWY|CWWidth|CWHeight|CWBorderWidth, &wc);
 	}
 }
 
@@ -1272,7 +1640,7 @@ focusstack(const Arg *arg)
 	}
 	if (c) {
 		focus(c);
-		restack(selmon);
+		setdirty(selmon, DirtyStack);
 	}
 }
 
@@ -1299,48 +1667,83 @@ getatomprop(Client *c, Atom prop)
 	return atom;
 }
 
-static uint32_t prealpha(uint32_t p) {
-	uint8_t a = p >> 24u;
-	uint32_t rb = (a * (p & 0xFF00FFu)) >> 8u;
-	uint32_t g = (a * (p & 0x00FF00u)) >> 8u;
-	return (rb & 0xFF00FFu) | (g & 0x00FF00u) | (a << 24u);
+/* Read len longs of _NET_WM_ICON of j's window at off, NULL unless all of
+ * them arrived. */
+xcb_get_property_reply_t *
+geticonpart(xcb_connection_t *xc, Iconjob *j, uint32_t off, uint32_t len)
+{
+	xcb_get_property_reply_t *r;
+
+	r = xcb_get_property_reply(xc, xcb_get_property(xc, 0, j->win,
+		netatom[NetWMIcon], AnyPropertyType, off, len), NULL);
+	j->reads++;
+	if (r)
+		j->bytes += xcb_get_property_value_length(r);
+	if (r && (r->format != 32 || xcb_get_property_value_length(r) / 4 < len)) {
+		free(r);
+		r = NULL;
+	}
+	return r;
 }
 
+/* Turn j->r, a _NET_WM_ICON reply, into a premultiplied ICONSIZE picture of
+ * j->icw by j->ich. It holds the first ICONPREFIX longs of the property. When more follows, the image
+ * headers past it are read two longs at a time and only the chosen image is
+ * downloaded, instead of every size an application ships. Converts the
+ * pixels in place. Runs on the icon worker with its connection and Drw.
+ * Clients with the same image share one Picture, see iconref(). */
 Picture
-geticonprop(Window win, unsigned int *picw, unsigned int *pich)
+geticonprop(xcb_connection_t *xc, Drw *dr, Iconjob *j)
 {
-	int format;
-	unsigned long n, extra, *p = NULL;
-	Atom real;
-
-	if (XGetWindowProperty(dpy, win, netatom[NetWMIcon], 0L, LONG_MAX, False, AnyPropertyType, 
-						   &real, &format, &n, &extra, (unsigned char **)&p) != Success)
-		return None; 
-	if (n == 0 || format != 32) { XFree(p); return None; }
-
-	unsigned long *bstp = NULL;
-	uint32_t w, h, sz;
-	{
-		unsigned long *i; const unsigned long *end = p + n;
-		uint32_t bstd = UINT32_MAX, d, m;
-		for (i = p; i < end - 1; i += sz) {
-			if ((w = *i++) > UINT16_MAX || (h = *i++) > UINT16_MAX) { XFree(p); return None; }
-			if ((sz = w * h) > end - i) break;
-			if ((m = w > h ? w : h) >= ICONSIZE && (d = m - ICONSIZE) < bstd) { bstd = d; bstp = i; }
-		}
-		if (!bstp) {
-			for (i = p; i < end - 1; i += sz) {
-				if ((w = *i++) > UINT16_MAX || (h = *i++) > UINT16_MAX) { XFree(p); return None; }
-				if ((sz = w * h) > end - i) break;
-				if ((d = ICONSIZE - (w > h ? w : h)) < bstd) { bstd = d; bstp = i; }
-			}
+	xcb_get_property_reply_t *r = j->r, *hdr, *part = NULL;
+	uint32_t *p, *px;
+	uint32_t w, h, sz, m, d, n, len, off, bst = 0, bstd = UINT32_MAX, bw = 0, bh = 0;
+	uint32_t icw, ich;
+	uint64_t key, t0 = statnow();
+	unsigned long bytes;
+	Picture ret;
+
+	if (!r || r->format != 32 || (n = xcb_get_property_value_length(r) / 4) < 2)
+		return None;
+	j->reads++;
+	j->bytes += n * 4;
+	p = xcb_get_property_value(r);
+	len = n + r->bytes_after / 4;
+	/* the smallest image at least ICONSIZE big, else the biggest */
+	for (off = 0; len - off >= 2; off += 2 + sz) {
+		if (off + 2 <= n) {
+			w = p[off];
+			h = p[off + 1];
+		} else if ((hdr = geticonpart(xc, j, off, 2))) {
+			w = ((uint32_t *)xcb_get_property_value(hdr))[0];
+			h = ((uint32_t *)xcb_get_property_value(hdr))[1];
+			free(hdr);
+		} else
+			break;
+		if (w > UINT16_MAX || h > UINT16_MAX)
+			return None;
+		if ((sz = w * h) > len - off - 2)
+			break;
+		m = w > h ? w : h;
+		d = m >= ICONSIZE ? m - ICONSIZE : UINT16_MAX + 1 + ICONSIZE - m;
+		if (d < bstd) {
+			bstd = d;
+			bst = off;
+			bw = w;
+			bh = h;
 		}
-		if (!bstp) { XFree(p); return None; }
 	}
+	if (bstd == UINT32_MAX || (w = bw) == 0 || (h = bh) == 0)
+		return None;
+
+	sz = w * h;
+	if (bst + 2 + sz <= n)
+		px = p + bst + 2;
+	else if ((part = geticonpart(xc, j, bst + 2, sz)))
+		px = xcb_get_property_value(part);
+	else
+		return None;
 
-	if ((w = *(bstp - 2)) == 0 || (h = *(bstp - 1)) == 0) { XFree(p); return None; }
-
-	uint32_t icw, ich;
 	if (w <= h) {
 		ich = ICONSIZE; icw = w * ICONSIZE / h;
 		if (icw == 0) icw = 1;
@@ -1349,14 +1752,29 @@ geticonprop(Window win, unsigned int *picw, unsigned int *pich)
 		icw = ICONSIZE; ich = h * ICONSIZE / w;
 		if (ich == 0) ich = 1;
 	}
-	*picw = icw; *pich = ich;
-
-	uint32_t i, *bstp32 = (uint32_t *)bstp;
-	for (sz = w * h, i = 0; i < sz; ++i) bstp32[i] = prealpha(bstp[i]);
-
-	Picture ret = drw_picture_create_resized(drw, (char *)bstp, w, h, icw, ich);
-	XFree(p);
-
+	j->icw = icw; j->ich = ich;
+
+	/* FNV-1a over the pixels, a word at a time */
+	key = 14695981039346656037u;
+	key = (key ^ w) * 1099511628211u;
+	key = (key ^ h) * 1099511628211u;
+	key = (key ^ icw) * 1099511628211u;
+	key = (key ^ ich) * 1099511628211u;
+	for (n = 0; n < sz; ++n)
+		key = (key ^ px[n]) * 1099511628211u;
+	if (!(ret = iconref(key, j))) {
+		drw_premultiply(px, sz);
+		ret = drw_picture_create_resized(dr, (char *)px, w, h, icw, ich);
+		/* drw_picture_create_resized() keeps the source unless it has to
+		 * shrink it more than twice */
+		bytes = 4ul * (w <= icw * 2 && h <= ich * 2 ? sz : icw * ich);
+		if (ret) {
+			iconrefadd(key, ret, bytes);
+			j->added += bytes;
+		}
+	}
+	free(part);
+	j->ns = statnow() - t0;
 	return ret;
 }
 
@@ -1370,24 +1788,6 @@ getrootptr(int *x, int *y)
 	return XQueryPointer(dpy, root, &dummy, &dummy, x, y, &di, &di, &dui);
 }
 
-long
-getstate(Window w)
-{
-	int format;
-	long result = -1;
-	unsigned char *p = NULL;
-	unsigned long n, extra;
-	Atom real;
-
-	if (XGetWindowProperty(dpy, w, wmatom[WMState], 0L, 2L, False, wmatom[WMState],
-		&real, &format, &n, &extra, (unsigned char **)&p) != Success)
-		return -1;
-	if (n != 0)
-		result = *p;
-	XFree(p);
-	return result;
-}
-
 unsigned int
 getsystraywidth()
 {
@@ -1401,26 +1801,17 @@ getsystraywidth()
 int
 gettextprop(Window w, Atom atom, char *text, unsigned int size)
 {
-	char **list = NULL;
-	int n;
 	XTextProperty name;
+	int ret;
 
 	if (!text || size == 0)
 		return 0;
 	text[0] = '\0';
-	if (!XGetTextProperty(dpy, w, &name, atom) || !name.nitems)
+	if (!XGetTextProperty(dpy, w, &name, atom))
 		return 0;
-	if (name.encoding == XA_STRING)
-		strncpy(text, (char *)name.value, size - 1);
-	else {
-		if (XmbTextPropertyToTextList(dpy, &name, &list, &n) >= Success && n > 0 && *list) {
-			strncpy(text, *list, size - 1);
-			XFreeStringList(list);
-		}
-	}
-	text[size - 1] = '\0';
+	ret = textprop(&name, text, size);
 	XFree(name.value);
-	return 1;
+	return ret;
 }
 
 void
@@ -1462,6 +1853,277 @@ grabkeys(void)
 	}
 }
 
+/* Show the outcome of j on c, replacing the icon it had. */
+void
+iconapply(Client *c, Iconjob *j)
+{
+	freeicon(c);
+	c->icon = j->icon;
+	c->icw = j->icon ? j->icw : 0;
+	c->ich = j->icon ? j->ich : 0;
+	c->icongen = 0;
+	c->noicon = !j->icon;
+	setdirty(c->mon, DirtyBar);
+	icontrim();
+}
+
+/* Take the jobs iconworker() finished. Results for clients that went away
+ * or asked again meanwhile are dropped. */
+void
+iconcollect(void)
+{
+	Iconjob *j, *next;
+	Client *c;
+
+	pthread_mutex_lock(&iconlock);
+	j = icondone;
+	icondone = NULL;
+	pthread_mutex_unlock(&iconlock);
+	for (; j; j = next) {
+		next = j->next;
+		iconcount(j);
+		if ((c = wintoclient(j->win)) && c->icongen == j->gen)
+			iconapply(c, j);
+		else if (j->icon)
+			iconunref(j->icon);
+		free(j);
+	}
+}
+
+/* Add what loading j cost to the counters. Main thread only, so a stats
+ * dump never sees them half updated. */
+void
+iconcount(Iconjob *j)
+{
+	iconreads += j->reads;
+	iconbytes += j->bytes;
+	iconhits += j->hits;
+	iconmisses += j->misses;
+	iconsaved += j->saved;
+	iconresident += j->added;
+	if (j->ns)
+		statadd(&iconhist, j->ns);
+}
+
+void
+iconload(xcb_connection_t *xc, Drw *d, Iconjob *j)
+{
+	j->r = xcb_get_property_reply(xc, xcb_get_property(xc, 0, j->win,
+		netatom[NetWMIcon], AnyPropertyType, 0, ICONPREFIX), NULL);
+	j->icon = geticonprop(xc, d, j);
+	free(j->r);
+	j->r = NULL;
+}
+
+/* Load the icon of c. With the worker running this returns at once and the
+ * bar shows a placeholder until the icon arrives, so a client with huge
+ * icons does not hold up the event loop. Clients last seen without an icon
+ * get no placeholder. */
+void
+iconqueue(Client *c)
+{
+	Iconjob *j;
+
+	j = ecalloc(1, sizeof(Iconjob));
+	j->win = c->win;
+	j->gen = c->icongen = ++iconseq;
+	if (!icondpy) {
+		iconload(xcon, drw, j);
+		iconcount(j);
+		iconapply(c, j);
+		free(j);
+		return;
+	}
+	if (!c->icon && !c->noicon)
+		c->icw = c->ich = ICONSIZE;
+	pthread_mutex_lock(&iconlock);
+	*icontail = j;
+	icontail = &j->next;
+	pthread_cond_signal(&iconwake);
+	pthread_mutex_unlock(&iconlock);
+}
+
+/* Take a reference to the Picture cached for key, None if there is none. */
+Picture
+iconref(uint64_t key, Iconjob *j)
+{
+	Iconref *i;
+	Picture pic = None;
+
+	pthread_mutex_lock(&iconreflock);
+	for (i = iconrefs; i && i->key != key; i = i->next);
+	if (i) {
+		i->refs++;
+		pic = i->pic;
+		j->hits++;
+		j->saved += i->bytes;
+	} else
+		j->misses++;
+	pthread_mutex_unlock(&iconreflock);
+	return pic;
+}
+
+void
+iconrefadd(uint64_t key, Picture pic, unsigned long bytes)
+{
+	Iconref *i = ecalloc(1, sizeof(Iconref));
+
+	i->key = key;
+	i->pic = pic;
+	i->refs = 1;
+	i->bytes = bytes;
+	pthread_mutex_lock(&iconreflock);
+	i->next = iconrefs;
+	iconrefs = i;
+	pthread_mutex_unlock(&iconreflock);
+}
+
+/* Whether pic has references besides the caller's, from other clients or
+ * from jobs not collected yet. Dropping ours would free nothing then. */
+int
+iconshared(Picture pic)
+{
+	Iconref *i;
+	int shared;
+
+	pthread_mutex_lock(&iconreflock);
+	for (i = iconrefs; i && i->pic != pic; i = i->next);
+	shared = i && i->refs > 1;
+	pthread_mutex_unlock(&iconreflock);
+	return shared;
+}
+
+void
+iconstart(void)
+{
+	iconready = XInternAtom(dpy, "_DWM_ICON_READY", False);
+	if (!(icondpy = XOpenDisplay(NULL)))
+		return; /* icons are loaded on the main thread then */
+	icondrw = drw_create(icondpy, screen, root, 1, 1);
+	if (pthread_create(&iconthread, NULL, iconworker, NULL)) {
+		drw_free(icondrw);
+		XCloseDisplay(icondpy);
+		icondpy = NULL;
+	}
+}
+
+void
+iconstop(void)
+{
+	Iconjob *j;
+
+	if (!icondpy)
+		return;
+	pthread_mutex_lock(&iconlock);
+	iconquit = 1;
+	pthread_cond_signal(&iconwake);
+	pthread_mutex_unlock(&iconlock);
+	pthread_join(iconthread, NULL);
+	iconcollect();
+	while ((j = icontodo)) {
+		icontodo = j->next;
+		free(j->r);
+		free(j);
+	}
+	icontail = &icontodo;
+	drw_free(icondrw);
+	XCloseDisplay(icondpy);
+	icondpy = NULL;
+}
+
+/* Free the icons of clients no bar shows, least recently shown first, until
+ * the Pictures in use fit in ICONBUDGET. They load again when shown. Shared
+ * icons are left alone, evicting them would not free their bytes. */
+void
+icontrim(void)
+{
+	Client *c, *lru;
+	Monitor *m;
+
+	while (iconresident > ICONBUDGET) {
+		lru = NULL;
+		for (m = mons; m; m = m->next)
+			for (c = m->clients; c; c = c->next)
+				if (c->icon && !ISVISIBLE(c) && (!lru || c->iconused < lru->iconused)
+				&& !iconshared(c->icon))
+					lru = c;
+		if (!lru)
+			return;
+		freeicon(lru);
+		lru->iconwant = 1;
+		iconevicted++;
+	}
+}
+
+/* Drop a reference taken by geticonprop(), freeing pic with the last one. */
+void
+iconunref(Picture pic)
+{
+	Iconref *i, **ip;
+
+	pthread_mutex_lock(&iconreflock);
+	for (ip = &iconrefs; (i = *ip) && i->pic != pic; ip = &i->next);
+	if (i && --i->refs == 0)
+		*ip = i->next;
+	else
+		i = NULL;
+	pthread_mutex_unlock(&iconreflock);
+	if (i) {
+		iconresident -= i->bytes;
+		XRenderFreePicture(dpy, pic);
+		free(i);
+	}
+}
+
+/* c is in a bar being drawn, load its icon if it is not there yet. */
+void
+iconuse(Client *c)
+{
+	c->iconused = ++iconclock;
+	if (c->iconwant) {
+		c->iconwant = 0;
+		iconqueue(c);
+	}
+}
+
+/* Runs the queued jobs on icondpy. Each job is synced before it is handed
+ * over, so its Picture exists on the server by the time the main loop can
+ * collect it, whichever IconReady message wakes it. Only the first job to
+ * finish after the main loop last collected sends one, to wmcheckwin. */
+void *
+iconworker(void *arg)
+{
+	xcb_connection_t *xc = XGetXCBConnection(icondpy);
+	XEvent ev = { .xclient = { .type = ClientMessage, .format = 32 } };
+	Iconjob *j;
+
+	ev.xclient.window = wmcheckwin;
+	ev.xclient.message_type = iconready;
+	pthread_mutex_lock(&iconlock);
+	while (!iconquit) {
+		if (!(j = icontodo)) {
+			pthread_cond_wait(&iconwake, &iconlock);
+			continue;
+		}
+		if (!(icontodo = j->next))
+			icontail = &icontodo;
+		pthread_mutex_unlock(&iconlock);
+		iconload(xc, icondrw, j);
+		XSync(icondpy, False);
+		pthread_mutex_lock(&iconlock);
+		j->next = icondone;
+		icondone = j;
+		if (!j->next) {
+			pthread_mutex_unlock(&iconlock);
+			XSendEvent(icondpy, wmcheckwin, False, NoEventMask, &ev);
+			XFlush(icondpy);
+			pthread_mutex_lock(&iconlock);
+		}
+	}
+	pthread_mutex_unlock(&iconlock);
+	return NULL;
+}
+
 void
 incnmaster(const Arg *arg)
 {
@@ -1515,10 +2177,31 @@ killclient(const Arg *arg)
 
 void
 manage(Window w, XWindowAttributes *wa)
+{
+	Props p;
+	uint64_t t0 = statnow();
+
+	/* everything manageprops() needs from the client in one round trip */
+	propsfetch(&p, w, MANAGEPROPS);
+	propsget(&p);
+	manageprops(w, wa, &p);
+	propsfree(&p);
+	focus(NULL);
+	stathist(&managehist, t0);
+}
+
+/* Adopt w using properties fetched beforehand. Leaves focus to the caller,
+ * so scan() can adopt many windows and focus once. */
+void
+manageprops(Window w, XWindowAttributes *wa, Props *p)
 {
 	Client *c, *t = NULL;
 	Window trans = None;
 	XWindowChanges wc;
+	XSizeHints size;
+	XWMHints wmh;
+	char cls[1025], *class = NULL, *instance = NULL;
+	int n;
 
 	c = ecalloc(1, sizeof(Client));
 	c->win = w;
@@ -1529,14 +2212,28 @@ manage(Window w, XWindowAttributes *wa)
 	c->h = c->oldh = wa->height;
 	c->oldbw = wa->border_width;
 
-	updateicon(c);
-	updatetitle(c);
-	if (XGetTransientForHint(dpy, w, &trans) && (t = wintoclient(trans))) {
+	c->iconwant = 1; /* loaded once a bar shows c */
+	c->noicon = !p->reply[PropIcon] || p->reply[PropIcon]->format != 32
+		|| p->reply[PropIcon]->bytes_after < 8;
+	if (!proptext(p->reply[PropNetWMName], c->name, sizeof c->name))
+		proptext(p->reply[PropWMName], c->name, sizeof c->name);
+	if (c->name[0] == '\0') /* hack to mark broken clients */
+		strcpy(c->name, broken);
+	if ((trans = propcard(p->reply[PropTransient], XA_WINDOW)) && (t = wintoclient(trans))) {
 		c->mon = t->mon;
 		c->tags = t->tags;
 	} else {
 		c->mon = selmon;
-		applyrules(c);
+		/* WM_CLASS is "instance\0class\0" */
+		if (p->reply[PropClass] && p->reply[PropClass]->format == 8) {
+			n = MIN(xcb_get_property_value_length(p->reply[PropClass]), sizeof cls - 1);
+			memcpy(cls, xcb_get_property_value(p->reply[PropClass]), n);
+			cls[n] = '\0';
+			instance = cls;
+			if (strlen(cls) < n)
+				class = cls + strlen(cls) + 1;
+		}
+		applyrules(c, class, instance);
 	}
 
 	if (c->x + WIDTH(c) > c->mon->mx + c->mon->mw)
@@ -1553,9 +2250,13 @@ manage(Window w, XWindowAttributes *wa)
 	XConfigureWindow(dpy, w, CWBorderWidth, &wc);
 	XSetWindowBorder(dpy, w, scheme[SchemeNorm][ColBorder].pixel);
 	configure(c); /* propagates border_width, if size doesn't change */
-	updatewindowtype(c);
-	updatesizehints(c);
-	updatewmhints(c);
+	setwindowtype(c, propcard(p->reply[PropWMState], XA_ATOM),
+		propcard(p->reply[PropWindowType], XA_ATOM));
+	if (!decodesizehints(p->reply[PropNormalHints], &size))
+		size.flags = PSize;
+	setsizehints(c, &size);
+	if (decodewmhints(p->reply[PropHints], &wmh))
+		setwmhints(c, &wmh);
 	XSelectInput(dpy, w, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
 	grabbuttons(c, 0);
 	if (!c->isfloating)
@@ -1564,6 +2265,8 @@ manage(Window w, XWindowAttributes *wa)
 		XRaiseWindow(dpy, c->win);
 	attach(c);
 	attachstack(c);
+	winmapadd(c->win, WinClient, c);
+	TRACE(TraceManage, c->win, c->mon->num, 0, 0, 0);
 	XChangeProperty(dpy, root, netatom[NetClientList], XA_WINDOW, 32, PropModeAppend,
 		(unsigned char *) &(c->win), 1);
 	XMoveResizeWindow(dpy, c->win, c->x + 2 * sw, c->y, c->w, c->h); /* some windows require this */
@@ -1572,8 +2275,8 @@ manage(Window w, XWindowAttributes *wa)
 		unfocus(selmon->sel, 0);
 	c->mon->sel = c;
 	arrange(c->mon);
+	arrangenow(c->mon); /* map c where it belongs, not off screen */
 	XMapWindow(dpy, c->win);
-	focus(NULL);
 }
 
 void
@@ -1595,7 +2298,7 @@ maprequest(XEvent *e)
 	if ((i = wintosystrayicon(ev->window))) {
 		sendevent(i->win, netatom[Xembed], StructureNotifyMask, CurrentTime, XEMBED_WINDOW_ACTIVATE, 0, systray->win, XEMBED_EMBEDDED_VERSION);
 		resizebarwin(selmon);
-		updatesystray();
+		setdirty(selmon, DirtySystray);
 	}
 
 	if (!XGetWindowAttributes(dpy, ev->window, &wa))
@@ -1651,6 +2354,7 @@ movemouse(const Arg *arg)
 		return;
 	if (c->isfullscreen) /* no support moving fullscreen windows by mouse */
 		return;
+	commit();
 	restack(selmon);
 	ocx = c->x;
 	ocy = c->y;
@@ -1661,6 +2365,7 @@ movemouse(const Arg *arg)
 		return;
 	do {
 		XMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
+		recevent(dpy, &ev);
 		switch(ev.type) {
 		case ConfigureRequest:
 		case Expose:
@@ -1689,6 +2394,7 @@ movemouse(const Arg *arg)
 				resize(c, nx, ny, c->w, c->h, 1);
 			break;
 		}
+		commit();
 	} while (ev.type != ButtonRelease);
 	XUngrabPointer(dpy, CurrentTime);
 	if ((m = recttomon(c->x, c->y, c->w, c->h)) != selmon) {
@@ -1714,6 +2420,30 @@ pop(Client *c)
 	arrange(c->mon);
 }
 
+/* first item of a 32 bit property of the given type, 0 if there is none */
+uint32_t
+propcard(xcb_get_property_reply_t *r, Atom type)
+{
+	if (!r || r->type != type || r->format != 32 || xcb_get_property_value_length(r) < 4)
+		return 0;
+	return *(uint32_t *)xcb_get_property_value(r);
+}
+
+int
+proptext(xcb_get_property_reply_t *r, char *text, unsigned int size)
+{
+	XTextProperty name;
+
+	text[0] = '\0';
+	if (!r || !r->type || !r->format)
+		return 0;
+	name.value = xcb_get_property_value(r);
+	name.encoding = r->type;
+	name.format = r->format;
+	name.nitems = xcb_get_property_value_length(r) / (r->format / 8);
+	return textprop(&name, text, size);
+}
+
 void
 propertynotify(XEvent *e)
 {
@@ -1729,7 +2459,7 @@ propertynotify(XEvent *e)
 		else
 			updatesystrayiconstate(c, ev);
 		resizebarwin(selmon);
-		updatesystray();
+		setdirty(selmon, DirtySystray);
 	}
 	if ((ev->window == root) && (ev->atom == XA_WM_NAME))
 		updatestatus();
@@ -1754,18 +2484,67 @@ propertynotify(XEvent *e)
 		if (ev->atom == XA_WM_NAME || ev->atom == netatom[NetWMName]) {
 			updatetitle(c);
 			if (c == c->mon->sel)
-				drawbar(c->mon);
+				setdirty(c->mon, DirtyBar);
 		}
 		else if (ev->atom == netatom[NetWMIcon]) {
 			updateicon(c);
 			if (c == c->mon->sel)
-				drawbar(c->mon);
+				setdirty(c->mon, DirtyBar);
 		}
 		if (ev->atom == netatom[NetWMWindowType])
 			updatewindowtype(c);
 	}
 }
 
+/* Send the property requests in mask without waiting, so fetching for one
+ * or many windows costs a single round trip in propsget(). */
+void
+propsfetch(Props *p, Window w, unsigned int mask)
+{
+	const struct { Atom atom, type; uint32_t len; } req[PropLast] = {
+		[PropNetWMName]   = { netatom[NetWMName], AnyPropertyType, 256 },
+		[PropWMName]      = { XA_WM_NAME, AnyPropertyType, 256 },
+		[PropTransient]   = { XA_WM_TRANSIENT_FOR, XA_WINDOW, 1 },
+		[PropClass]       = { XA_WM_CLASS, XA_STRING, 256 },
+		[PropWMState]     = { netatom[NetWMState], XA_ATOM, 1 },
+		[PropWindowType]  = { netatom[NetWMWindowType], XA_ATOM, 1 },
+		[PropNormalHints] = { XA_WM_NORMAL_HINTS, XA_WM_SIZE_HINTS, 18 },
+		[PropHints]       = { XA_WM_HINTS, XA_WM_HINTS, 9 },
+		[PropIcon]        = { netatom[NetWMIcon], AnyPropertyType, 0 }, /* size only */
+		[PropState]       = { wmatom[WMState], wmatom[WMState], 2 },
+	};
+	int i;
+
+	p->mask = mask;
+	for (i = 0; i < PropLast; i++) {
+		p->reply[i] = NULL;
+		if (mask & 1 << i)
+			p->cookie[i] = xcb_get_property(xcon, 0, w, req[i].atom, req[i].type, 0, req[i].len);
+	}
+}
+
+void
+propsfree(Props *p)
+{
+	int i;
+
+	for (i = 0; i < PropLast; i++) {
+		free(p->reply[i]);
+		p->reply[i] = NULL;
+	}
+}
+
+/* Errors (the window is gone) reach xerror() through the event queue. */
+void
+propsget(Props *p)
+{
+	int i;
+
+	for (i = 0; i < PropLast; i++)
+		if (p->mask & 1 << i)
+			p->reply[i] = xcb_get_property_reply(xcon, p->cookie[i], NULL);
+}
+
 void pullwin(const Arg *arg)
 {
    Client *c = NULL;
@@ -1875,6 +2654,7 @@ removesystrayicon(Client *i)
 	for (ii = &systray->icons; *ii && *ii != i; ii = &(*ii)->next);
 	if (ii)
 		*ii = i->next;
+	winmapdel(i->win, WinSystrayIcon);
 	free(i);
 }
 
@@ -1882,8 +2662,7 @@ removesystrayicon(Client *i)
 void
 resize(Client *c, int x, int y, int w, int h, int interact)
 {
-   printf("resize: (%p) %d %d %d %d\n",
-         (void*) c, x, y, w, h);
+	TRACE(TraceResize, c->win, x, y, w, h);
 
 	if (applysizehints(c, &x, &y, &w, &h, interact))
 		resizeclient(c, x, y, w, h);
@@ -1901,15 +2680,22 @@ void
 resizeclient(Client *c, int x, int y, int w, int h)
 {
 	XWindowChanges wc;
+	int unchanged = x == c->x && y == c->y && w == c->w && h == c->h;
 
 	c->oldx = c->x; c->x = wc.x = x;
 	c->oldy = c->y; c->y = wc.y = y;
 	c->oldw = c->w; c->w = wc.width = w;
 	c->oldh = c->h; c->h = wc.height = h;
+	if (batching) {
+		c->confpending = 1;
+		return;
+	}
 	wc.border_width = c->bw;
 	XConfigureWindow(dpy, c->win, CWX|CWY|CWWidth|CWHeight|CWBorderWidth, &wc);
-	configure(c);
-	XSync(dpy, False);
+	/* the server only reports real changes, ICCCM 4.1.5 wants a synthetic
+	 * ConfigureNotify when the geometry stays the same */
+	if (unchanged)
+		configure(c);
 }
 
 void
@@ -1925,6 +2711,7 @@ resizemouse(const Arg *arg)
 		return;
 	if (c->isfullscreen) /* no support resizing fullscreen windows by mouse */
 		return;
+	commit();
 	restack(selmon);
 	ocx = c->x;
 	ocy = c->y;
@@ -1934,6 +2721,7 @@ resizemouse(const Arg *arg)
 	XWarpPointer(dpy, None, c->win, 0, 0, 0, 0, c->w + c->bw - 1, c->h + c->bw - 1);
 	do {
 		XMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
+		recevent(dpy, &ev);
 		switch(ev.type) {
 		case ConfigureRequest:
 		case Expose:
@@ -1958,6 +2746,7 @@ resizemouse(const Arg *arg)
 				resize(c, c->x, c->y, nw, nh, 1);
 			break;
 		}
+		commit();
 	} while (ev.type != ButtonRelease);
 	XWarpPointer(dpy, None, c->win, 0, 0, 0, 0, c->w + c->bw - 1, c->h + c->bw - 1);
 	XUngrabPointer(dpy, CurrentTime);
@@ -1978,7 +2767,7 @@ resizerequest(XEvent *e)
 	if ((i = wintosystrayicon(ev->window))) {
 		updatesystrayicongeom(i, ev->width, ev->height);
 		resizebarwin(selmon);
-		updatesystray();
+		setdirty(selmon, DirtySystray);
 	}
 }
 
@@ -1989,7 +2778,7 @@ restack(Monitor *m)
 	XEvent ev;
 	XWindowChanges wc;
 
-	drawbar(m);
+	setdirty(m, DirtyBar);
 	if (!m->sel)
 		return;
 	if (m->sel->isfloating || !m->lt[m->sellt]->arrange)
@@ -2042,19 +2831,34 @@ rotatestack(const Arg *arg)
      unsigned i;
      for (i = 0, c = nexttiled(selmon->clients); c && i != n; c = nexttiled(c->next), i ++);
      if (c) focus(c);
-     restack(selmon);
   }
 }
 
 void
 run(void)
 {
+	const unsigned int maxbatch = 64; /* commit at least this often */
+	unsigned int n = 0;
 	XEvent ev;
+	uint64_t t0;
 	/* main event loop */
 	XSync(dpy, False);
-	while (running && !XNextEvent(dpy, &ev))
-		if (handler[ev.type])
+	commit();
+	while (running && !XNextEvent(dpy, &ev)) {
+		compressev(&ev);
+		TRACE(TraceEvent, ev.type, ev.xany.window, 0, 0, 0);
+		if (handler[ev.type]) {
+			t0 = statnow();
 			handler[ev.type](&ev); /* call handler */
+			stathist(&evhist[ev.type], t0);
+		}
+		/* arrange and redraw once per batch of events */
+		if (++n >= maxbatch || !XPending(dpy)) {
+			commit();
+			n = 0;
+			nrequests = NextRequest(dpy) - 1;
+		}
+	}
 }
 
 void
@@ -2124,28 +2928,78 @@ cleanup:
 void
 scan(void)
 {
-	unsigned int i, num;
+	struct {
+		Window win;
+		xcb_get_window_attributes_cookie_t ac;
+		xcb_get_geometry_cookie_t gc;
+		XWindowAttributes wa;
+		Props p;
+	} batch[32], *trans = NULL; /* windows in flight, bounds reply memory */
+	unsigned int i, j, n, num, ntrans = 0, nmanaged = 0;
 	Window d1, d2, *wins = NULL;
-	XWindowAttributes wa;
-
-	if (XQueryTree(dpy, root, &d1, &d2, &wins, &num)) {
-		for (i = 0; i < num; i++) {
-			if (!XGetWindowAttributes(dpy, wins[i], &wa)
-			|| wa.override_redirect || XGetTransientForHint(dpy, wins[i], &d1))
-				continue;
-			if (wa.map_state == IsViewable || getstate(wins[i]) == IconicState)
-				manage(wins[i], &wa);
+	xcb_get_window_attributes_reply_t *ar;
+	xcb_get_geometry_reply_t *gr;
+	XWindowAttributes *wa;
+	int keep;
+	unsigned long req = NextRequest(dpy);
+	uint64_t t0 = statnow();
+
+	if (!XQueryTree(dpy, root, &d1, &d2, &wins, &num))
+		return;
+	for (i = 0; i < num; i += n) {
+		n = MIN(num - i, LENGTH(batch));
+		for (j = 0; j < n; j++) {
+			batch[j].win = wins[i + j];
+			batch[j].ac = xcb_get_window_attributes(xcon, wins[i + j]);
+			batch[j].gc = xcb_get_geometry(xcon, wins[i + j]);
+			propsfetch(&batch[j].p, wins[i + j], (1 << PropLast) - 1);
 		}
-		for (i = 0; i < num; i++) { /* now the transients */
-			if (!XGetWindowAttributes(dpy, wins[i], &wa))
-				continue;
-			if (XGetTransientForHint(dpy, wins[i], &d1)
-			&& (wa.map_state == IsViewable || getstate(wins[i]) == IconicState))
-				manage(wins[i], &wa);
+		for (j = 0; j < n; j++) {
+			ar = xcb_get_window_attributes_reply(xcon, batch[j].ac, NULL);
+			gr = xcb_get_geometry_reply(xcon, batch[j].gc, NULL);
+			propsget(&batch[j].p);
+			keep = ar && gr && !ar->override_redirect
+				&& (ar->map_state == IsViewable
+				|| propcard(batch[j].p.reply[PropState], wmatom[WMState]) == IconicState);
+			if (keep) {
+				wa = &batch[j].wa;
+				memset(wa, 0, sizeof *wa);
+				wa->x = gr->x;
+				wa->y = gr->y;
+				wa->width = gr->width;
+				wa->height = gr->height;
+				wa->border_width = gr->border_width;
+				wa->map_state = ar->map_state;
+			}
+			free(ar);
+			free(gr);
+			if (!keep) {
+				propsfree(&batch[j].p);
+			} else if (propcard(batch[j].p.reply[PropTransient], XA_WINDOW)) {
+				/* transients go last, so the windows they belong to exist */
+				if (!(trans = realloc(trans, (ntrans + 1) * sizeof *trans)))
+					die("realloc:");
+				trans[ntrans++] = batch[j];
+			} else {
+				manageprops(batch[j].win, &batch[j].wa, &batch[j].p);
+				propsfree(&batch[j].p);
+				nmanaged++;
+			}
 		}
-		if (wins)
-			XFree(wins);
 	}
+	for (i = 0; i < ntrans; i++) {
+		manageprops(trans[i].win, &trans[i].wa, &trans[i].p);
+		propsfree(&trans[i].p);
+		nmanaged++;
+	}
+	free(trans);
+	if (wins)
+		XFree(wins);
+	/* arrange is deferred to the first commit(), focus once for all */
+	if (nmanaged)
+		focus(NULL);
+	fprintf(stderr, "dwm: scan: managed %u of %u windows in %.1f ms, %lu requests\n",
+		nmanaged, num, (statnow() - t0) / 1e6, NextRequest(dpy) - req);
 }
 
 void
@@ -2164,6 +3018,109 @@ sendmon(Client *c, Monitor *m)
 	arrange(NULL);
 }
 
+/* Append a segment to the bar being drawn. Its fingerprint covers the
+ * position and everything drawseg() reads, so an equal fingerprint means
+ * the retained pixels are still right. */
+Seg *
+segadd(Monitor *m, int type, int x, int w, unsigned int flags, const char *text, Client *c)
+{
+	unsigned long v[] = { type, x, w, flags, c ? c->icon : 0, c ? c->icw : 0, c ? c->ich : 0 };
+	unsigned long fp = 2166136261u;
+	const unsigned char *p;
+	Seg *s;
+
+	for (p = (const unsigned char *)v; p < (const unsigned char *)(v + LENGTH(v)); p++)
+		fp = (fp ^ *p) * 16777619u;
+	for (p = (const unsigned char *)text; *p; p++)
+		fp = (fp ^ *p) * 16777619u;
+	if (nsegs == segscap) {
+		segscap = segscap ? segscap * 2 : 64;
+		if (!(segs = realloc(segs, segscap * sizeof *segs)))
+			die("realloc:");
+	}
+	s = &segs[nsegs++];
+	*s = (Seg){ type, x, w, flags, text, 0, c, fp, 0 };
+	return s;
+}
+
+#define SEGOVERLAP(A, B) ((A).w > 0 && (B).w > 0 && (A).x < (B).x + (B).w && (B).x < (A).x + (A).w)
+
+/* whether segment j sits where a rendered segment is now or was before */
+int
+segdamaged(Monitor *m, unsigned int j)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX(nsegs, m->nseg); i++) {
+		if (i == j)
+			continue;
+		if (i < nsegs && segs[i].drawn && SEGOVERLAP(segs[j], segs[i]))
+			return 1;
+		if (i < m->nseg && (i >= nsegs || segs[i].drawn) && SEGOVERLAP(segs[j], m->seg[i]))
+			return 1;
+	}
+	return 0;
+}
+
+/* Render the segments whose fingerprint changed, plus any they overlap so
+ * paint order is kept, and copy only those to the bar window. */
+void
+segflush(Monitor *m, int stw)
+{
+	unsigned int i, more, cap;
+	unsigned long px = 0;
+	int w;
+	Seg *s;
+
+	for (i = 0; i < nsegs; i++)
+		segs[i].drawn = i >= m->nseg || segs[i].fp != m->seg[i].fp;
+	do {
+		more = 0;
+		for (i = 0; i < nsegs; i++)
+			if (!segs[i].drawn && segdamaged(m, i))
+				segs[i].drawn = more = 1;
+	} while (more);
+
+	for (i = 0; i < nsegs; i++) {
+		s = &segs[i];
+		if (!s->drawn || s->w <= 0) {
+			segkept++;
+			continue;
+		}
+		drawseg(m, s);
+		if ((w = MIN(s->w, m->ww - stw - s->x)) > 0)
+			drw_map(drw, m->barwin, s->x, 0, w, bh);
+		px += (unsigned long)s->w * bh;
+		segdrawn++;
+	}
+	statadd(&barpixelhist, px);
+
+	/* keep this bar's segments, reuse the old array for the next one */
+	s = m->seg;
+	cap = m->segcap;
+	m->seg = segs;
+	m->segcap = segscap;
+	m->nseg = nsegs;
+	segs = s;
+	segscap = cap;
+	nsegs = 0;
+}
+
+/* schedule work for m, or for all monitors if m is NULL */
+void
+setdirty(Monitor *m, unsigned int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < LENGTH(dirtyname); i++)
+		if (flags & 1 << i)
+			dirtyreq[i]++;
+	if (m)
+		m->dirty |= flags;
+	else for (m = mons; m; m = m->next)
+		m->dirty |= flags;
+}
+
 void
 setclientstate(Client *c, long state)
 {
@@ -2259,7 +3216,7 @@ setlayout(const Arg *arg)
 	if (selmon->sel)
 		arrange(selmon);
 	else
-		drawbar(selmon);
+		setdirty(selmon, DirtyBar);
 }
 
 /* arg > 1.0 will set mfact absolutely */
@@ -2286,15 +3243,51 @@ setup(void)
 
 	/* clean up any zombies immediately */
 	sigchld(0);
+	TRACEINIT();
+	statinit();
+	for (i = 0; i < LASTEvent; i++)
+		if (handler[i]) {
+			stathistreg("event", evname[i], &evhist[i]);
+			statcountreg("received", evname[i], &evcount[i]);
+			statcountreg("compressed", evname[i], &evcompressed[i]);
+		}
+	stathistreg("arrange", NULL, &arrangehist);
+	stathistreg("restack", NULL, &restackhist);
+	stathistreg("drawbar", NULL, &drawbarhist);
+	stathistreg("manage", NULL, &managehist);
+	stathistreg("unmanage", NULL, &unmanagehist);
+	stathistreg("geticonprop", NULL, &iconhist);
+	stathistreg("s_layout", NULL, &slayouthist);
+	statcountreg("requests", NULL, &nrequests);
+	statcountreg("expose", "blits", &exposeblits);
+	statcountreg("segments", "drawn", &segdrawn);
+	statcountreg("segments", "kept", &segkept);
+	statcountreg("tagsprites", "rendered", &tagsprited);
+	statcountreg("icon", "reads", &iconreads);
+	statcountreg("icon", "bytes", &iconbytes);
+	statcountreg("iconcache", "hits", &iconhits);
+	statcountreg("iconcache", "misses", &iconmisses);
+	statcountreg("iconcache", "saved", &iconsaved);
+	statcountreg("iconcache", "resident", &iconresident);
+	statcountreg("iconcache", "evicted", &iconevicted);
+	stathistreg("drawbar", "pixels", &barpixelhist);
+	for (i = 0; i < LENGTH(dirtyname); i++) {
+		statcountreg("requested", dirtyname[i], &dirtyreq[i]);
+		statcountreg("done", dirtyname[i], &dirtydone[i]);
+	}
 
 	/* init screen */
 	screen = DefaultScreen(dpy);
 	sw = DisplayWidth(dpy, screen);
 	sh = DisplayHeight(dpy, screen);
 	root = RootWindow(dpy, screen);
-	drw = drw_create(dpy, screen, root, sw, sh);
+	drw = drw_create(dpy, screen, root, 1, 1); /* bars draw into Monitor.bar */
+	statcountreg("textw", "hits", &drw->whits);
+	statcountreg("textw", "misses", &drw->wmisses);
+	statcountreg("fallback", "matches", &drw->fcmatches);
 	if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
 		die("no fonts could be loaded.");
+	drw_fontset_probe(drw);
 	lrpad = drw->fonts->h;
 	bh = drw->fonts->h + 2;
 	updategeom();
@@ -2340,6 +3333,7 @@ setup(void)
 		PropModeReplace, (unsigned char *) &wmcheckwin, 1);
 	XChangeProperty(dpy, wmcheckwin, netatom[NetWMName], utf8string, 8,
 		PropModeReplace, (unsigned char *) "dwm", 3);
+	iconstart();
 	XChangeProperty(dpy, root, netatom[NetWMCheck], XA_WINDOW, 32,
 		PropModeReplace, (unsigned char *) &wmcheckwin, 1);
 	/* EWMH support per view */
@@ -2423,6 +3417,43 @@ tag(const Arg *arg)
 	}
 }
 
+/* The cell of tag i in the given state, rendered from text the first time
+ * it is needed and copied into the bar from then on. Leaves drw drawing
+ * where it was. */
+Buf *
+tagsprite(unsigned int i, unsigned int flags, int w)
+{
+	int boxs = drw->fonts->h / 9;
+	int boxw = drw->fonts->h / 6 + 2;
+	Buf **b = &tagsprites[i][flags], *prev = drw->buf;
+
+	if (*b && (*b)->w == (unsigned int)w)
+		return *b;
+	if (*b)
+		drw_buf_resize(drw, *b, w, bh);
+	else
+		*b = drw_buf_create(drw, w, bh);
+	drw_setbuf(drw, *b);
+	drw_setscheme(drw, scheme[flags & SegSel ? SchemeSel : SchemeNorm]);
+	drw_text(drw, 0, 0, w, bh, lrpad / 2, tags[i], flags & SegUrg);
+	if (flags & SegBox)
+		drw_rect(drw, boxs, boxs, boxw, boxw, flags & SegFilled, flags & SegUrg);
+	drw_setbuf(drw, prev);
+	tagsprited++;
+	return *b;
+}
+
+void
+freetagsprites(unsigned int i)
+{
+	unsigned int j;
+
+	for (j = 0; j < LENGTH(tagsprites[i]); j++) {
+		drw_buf_free(drw, tagsprites[i][j]);
+		tagsprites[i][j] = NULL;
+	}
+}
+
 void
 tagmon(const Arg *arg)
 {
@@ -2431,6 +3462,30 @@ tagmon(const Arg *arg)
 	sendmon(selmon->sel, dirtomon(arg->i));
 }
 
+/* name.value need not be terminated */
+int
+textprop(XTextProperty *name, char *text, unsigned int size)
+{
+	char **list = NULL;
+	int n;
+
+	text[0] = '\0';
+	if (!name->nitems)
+		return 0;
+	if (name->encoding == XA_STRING) {
+		n = MIN(name->nitems, size - 1);
+		memcpy(text, name->value, n);
+		text[n] = '\0';
+	} else {
+		if (XmbTextPropertyToTextList(dpy, name, &list, &n) >= Success && n > 0 && *list) {
+			strncpy(text, *list, size - 1);
+			XFreeStringList(list);
+		}
+	}
+	text[size - 1] = '\0';
+	return 1;
+}
+
 void
 tile(Monitor *m)
 {
@@ -2464,12 +3519,12 @@ tile(Monitor *m)
    {
 		if (i < m->nmaster) {
 			h = (m->wh - my) / (MIN(n, m->nmaster) - i);
-         printf("wx:%d, wy:%d, wh:%d, ww:%d;  my:%d, mw:%d, h:%d\n", m->wx, m->wy, m->wh, m->ww, my, mw, h);
+			TRACE(TraceTileMaster, c->win, m->wx, m->wy + my, mw, h);
 			resize(c, m->wx, m->wy + my, mw - (2*c->bw), h - (2*c->bw), 0);
 			my += HEIGHT(c);
       } else if (cpt > 0 && i >= n) {
          h = m->wh / cpt;
-         printf("wx:%d, wy:%d, wh:%d, ww:%d;  my:%d, mw:%d, h:%d\n", m->wx, m->wy, m->wh, m->ww, my, mw, h);
+         TRACE(TraceTileSide, c->win, m->wx + mw, m->wy + m->wh - h, m->ww - mw, h);
          resize(c, 
                m->wx + mw,
                m->wy + m->wh - h,
@@ -2477,7 +3532,7 @@ tile(Monitor *m)
                h - (2*c->bw), 0);
 		} else {
 			h = (m->wh - ty) / (n - i);
-         printf("wx:%d, wy:%d, wh:%d, ww:%d;  my:%d, mw:%d, h:%d\n", m->wx, m->wy, m->wh, m->ww, my, mw, h);
+			TRACE(TraceTileStack, c->win, m->wx + mw, m->wy + ty, m->ww - mw, h);
 			resize(c, m->wx + mw, m->wy + ty, m->ww - mw - (2*c->bw), h - (2*c->bw), 0);
 			ty += HEIGHT(c);
 		}
@@ -2602,9 +3657,10 @@ void
 freeicon(Client *c)
 {
 	if (c->icon) {
-		XRenderFreePicture(dpy, c->icon);
+		iconunref(c->icon);
 		c->icon = None;
 	}
+	c->icw = c->ich = 0;
 }
 
 void
@@ -2625,9 +3681,12 @@ unmanage(Client *c, int destroyed)
 {
 	Monitor *m = c->mon;
 	XWindowChanges wc;
+	uint64_t t0 = statnow();
 
 	detach(c);
 	detachstack(c);
+	winmapdel(c->win, WinClient);
+	TRACE(TraceUnmanage, c->win, destroyed, 0, 0, 0);
 	freeicon(c);
 	if (!destroyed) {
 		wc.border_width = c->oldbw;
@@ -2644,6 +3703,7 @@ unmanage(Client *c, int destroyed)
 	focus(NULL);
 	updateclientlist();
 	arrange(m);
+	stathist(&unmanagehist, t0);
 }
 
 void
@@ -2662,7 +3722,7 @@ unmapnotify(XEvent *e)
 		/* KLUDGE! sometimes icons occasionally unmap their windows, but do
 		 * _not_ destroy them. We map those windows back */
 		XMapRaised(dpy, c->win);
-		updatesystray();
+		setdirty(selmon, DirtySystray);
 	}
 }
 
@@ -2687,6 +3747,7 @@ updatebars(void)
 				CopyFromParent, DefaultVisual(dpy, screen),
 				CWOverrideRedirect|CWBackPixmap|CWEventMask, &wa);
 		XDefineCursor(dpy, m->barwin, cursor[CurNormal]->cursor);
+		winmapadd(m->barwin, WinBar, m);
 		if (showsystray && m == systraytomon(m))
 			XMapRaised(dpy, systray->win);
 		XMapRaised(dpy, m->barwin);
@@ -2705,6 +3766,11 @@ updatebarpos(Monitor *m)
 		m->wy = m->topbar ? m->wy + bh : m->wy;
 	} else
 		m->by = -bh;
+	if (m->bar && (m->bar->w != m->ww || m->bar->h != bh)) {
+		drw_buf_resize(drw, m->bar, m->ww, bh);
+		m->nseg = 0;
+		setdirty(m, DirtyBar); /* the retained image is gone */
+	}
 }
 
 void
@@ -2824,6 +3890,14 @@ updatesizehints(Client *c)
 	if (!XGetWMNormalHints(dpy, c->win, &size, &msize))
 		/* size is uninitialized, ensure that size.flags aren't used */
 		size.flags = PSize;
+	setsizehints(c, &size);
+}
+
+void
+setsizehints(Client *c, XSizeHints *hints)
+{
+	XSizeHints size = *hints;
+
 	if (size.flags & PBaseSize) {
 		c->basew = size.base_width;
 		c->baseh = size.base_height;
@@ -2863,8 +3937,7 @@ updatestatus(void)
 {
 	if (!gettextprop(root, XA_WM_NAME, stext, sizeof(stext)))
 		strcpy(stext, "dwm-"VERSION);
-	drawbar(selmon);
-	updatesystray();
+	setdirty(selmon, DirtyBar|DirtySystray);
 }
 
 void
@@ -2993,16 +4066,21 @@ updatetitle(Client *c)
 void
 updateicon(Client *c)
 {
-	freeicon(c);
-	c->icon = geticonprop(c->win, &c->icw, &c->ich);
+	c->iconwant = 1;
+	if (ISVISIBLE(c))
+		setdirty(c->mon, DirtyBar);
 }
 
 void
 updatewindowtype(Client *c)
 {
-	Atom state = getatomprop(c, netatom[NetWMState]);
-	Atom wtype = getatomprop(c, netatom[NetWMWindowType]);
+	setwindowtype(c, getatomprop(c, netatom[NetWMState]),
+		getatomprop(c, netatom[NetWMWindowType]));
+}
 
+void
+setwindowtype(Client *c, Atom state, Atom wtype)
+{
 	if (state == netatom[NetWMFullscreen])
 		setfullscreen(c, 1);
 	if (wtype == netatom[NetWMWindowTypeDialog])
@@ -3015,19 +4093,25 @@ updatewmhints(Client *c)
 	XWMHints *wmh;
 
 	if ((wmh = XGetWMHints(dpy, c->win))) {
-		if (c == selmon->sel && wmh->flags & XUrgencyHint) {
-			wmh->flags &= ~XUrgencyHint;
-			XSetWMHints(dpy, c->win, wmh);
-		} else
-			c->isurgent = (wmh->flags & XUrgencyHint) ? 1 : 0;
-		if (wmh->flags & InputHint)
-			c->neverfocus = !wmh->input;
-		else
-			c->neverfocus = 0;
+		setwmhints(c, wmh);
 		XFree(wmh);
 	}
 }
 
+void
+setwmhints(Client *c, XWMHints *wmh)
+{
+	if (c == selmon->sel && wmh->flags & XUrgencyHint) {
+		wmh->flags &= ~XUrgencyHint;
+		XSetWMHints(dpy, c->win, wmh);
+	} else
+		c->isurgent = (wmh->flags & XUrgencyHint) ? 1 : 0;
+	if (wmh->flags & InputHint)
+		c->neverfocus = !wmh->input;
+	else
+		c->neverfocus = 0;
+}
+
 void
 view(const Arg *arg)
 {
@@ -3107,8 +4191,10 @@ nametag(const Arg *arg)
       *p = '\0';
 
    for(i = 0; i < LENGTH(tags); i++)
-      if(selmon->tagset[selmon->seltags] & (1 << i))
+      if(selmon->tagset[selmon->seltags] & (1 << i)) {
          strcpy(tags[i], name);
+         freetagsprites(i);
+      }
 
    drawbars();
 
@@ -3127,19 +4213,78 @@ nexttag(const Arg *arg)
    arrange(selmon);
 }
 
-Client *
-wintoclient(Window w)
+static unsigned int
+winhash(Window w, unsigned int bits)
 {
-	Client *c;
-	Monitor *m;
+	return ((uint32_t)w * 2654435761u) >> (32 - bits);
+}
 
-	for (m = mons; m; m = m->next)
-		for (c = m->clients; c; c = c->next)
-			if (c->win == w)
-				return c;
+void
+winmapadd(Window w, int type, void *p)
+{
+	Winref *r, *next, **old;
+	unsigned int i, h, oldsz;
+
+	if (!winmap || winmapn >= 1u << winmapbits) {
+		/* grow to keep the load factor below one */
+		old = winmap;
+		oldsz = old ? 1u << winmapbits : 0;
+		winmapbits = old ? winmapbits + 1 : 6;
+		winmap = ecalloc(1u << winmapbits, sizeof(Winref *));
+		for (i = 0; i < oldsz; i++)
+			for (r = old[i]; r; r = next) {
+				next = r->next;
+				h = winhash(r->win, winmapbits);
+				r->next = winmap[h];
+				winmap[h] = r;
+			}
+		free(old);
+	}
+	r = ecalloc(1, sizeof(Winref));
+	r->win = w;
+	r->type = type;
+	r->p = p;
+	h = winhash(w, winmapbits);
+	r->next = winmap[h];
+	winmap[h] = r;
+	winmapn++;
+}
+
+void
+winmapdel(Window w, int type)
+{
+	Winref **rr, *r;
+
+	if (!winmap)
+		return;
+	for (rr = &winmap[winhash(w, winmapbits)]; (r = *rr); rr = &r->next)
+		if (r->win == w && r->type == type) {
+			*rr = r->next;
+			free(r);
+			winmapn--;
+			return;
+		}
+}
+
+void *
+winmapget(Window w, int type)
+{
+	Winref *r;
+
+	if (!winmap)
+		return NULL;
+	for (r = winmap[winhash(w, winmapbits)]; r; r = r->next)
+		if (r->win == w && r->type == type)
+			return r->p;
 	return NULL;
 }
 
+Client *
+wintoclient(Window w)
+{
+	return winmapget(w, WinClient);
+}
+
 void
 tonexttag(const Arg *arg)
 {
@@ -3160,12 +4305,9 @@ tonexttag(const Arg *arg)
 
 Client *
 wintosystrayicon(Window w) {
-	Client *i = NULL;
-
 	if (!showsystray || !w)
-		return i;
-	for (i = systray->icons; i && i->win != w; i = i->next) ;
-	return i;
+		return NULL;
+	return winmapget(w, WinSystrayIcon);
 }
 
 Monitor *
@@ -3177,9 +4319,8 @@ wintomon(Window w)
 
 	if (w == root && getrootptr(&x, &y))
 		return recttomon(x, y, 1, 1);
-	for (m = mons; m; m = m->next)
-		if (w == m->barwin)
-			return m;
+	if ((m = winmapget(w, WinBar)))
+		return m;
 	if ((c = wintoclient(w)))
 		return c->mon;
 	return selmon;
@@ -3260,15 +4401,23 @@ runAutostart()
 int
 main(int argc, char *argv[])
 {
+	const char *recfile = NULL;
+
 	if (argc == 2 && !strcmp("-v", argv[1]))
 		die("dwm-"VERSION);
+	else if (argc == 3 && !strcmp("-r", argv[1]))
+		recfile = argv[2];
 	else if (argc != 1)
-		die("usage: dwm [-v]");
+		die("usage: dwm [-v] [-r file]");
 	if (!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		fputs("warning: no locale support\n", stderr);
+	XInitThreads(); /* the icon worker has a connection of its own */
 	if (!(dpy = XOpenDisplay(NULL)))
 		die("dwm: cannot open display");
+	xcon = XGetXCBConnection(dpy);
 	checkotherwm();
+	if (recfile && recopen(dpy, recfile) < 0)
+		die("dwm: cannot open %s:", recfile);
 	setup();
 #ifdef __OpenBSD__
 	if (pledge("stdio rpath proc exec", NULL) == -1)
@@ -3288,6 +4437,7 @@ main(int argc, char *argv[])
    // Run
 	run();
 	cleanup();
+	recclose();
 	XCloseDisplay(dpy);
 
    if (restart)
@@ -0,0 +1,190 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include "record.h"
+#include "stats.h"
+#include "util.h"
+
+static FILE *rec;
+static uint64_t start;
+static Window root;
+static Atom netwmstate;
+
+static uint32_t
+recwin(Window w)
+{
+	return w == root ? 0 : (uint32_t)w;
+}
+
+static void
+put(RecEv *r, const char *s[3])
+{
+	int i;
+
+	fwrite(r, sizeof *r, 1, rec);
+	for (i = 0; i < 3; i++)
+		if (r->len[i])
+			fwrite(s[i], 1, r->len[i], rec);
+}
+
+static void
+setstr(RecEv *r, const char *s[3], int i, const char *str, size_t len)
+{
+	s[i] = str;
+	r->len[i] = str ? len : 0;
+}
+
+int
+recopen(Display *dpy, const char *path)
+{
+	int screen = DefaultScreen(dpy);
+	RecHdr h = { RECMAGIC, RECVER, DisplayWidth(dpy, screen), DisplayHeight(dpy, screen) };
+
+	if (!(rec = fopen(path, "wb")))
+		return -1;
+	root = RootWindow(dpy, screen);
+	netwmstate = XInternAtom(dpy, "_NET_WM_STATE", False);
+	start = statnow();
+	fwrite(&h, sizeof h, 1, rec);
+	return 0;
+}
+
+void
+recclose(void)
+{
+	if (rec)
+		fclose(rec);
+	rec = NULL;
+}
+
+/* Store what a replayer needs to cause the same event again. The metadata
+ * lookups cost round trips, but only while recording. */
+void
+recevent(Display *dpy, XEvent *ev)
+{
+	RecEv r = { 0 };
+	const char *s[3] = { NULL, NULL, NULL };
+	char *name = NULL, *type = NULL, *title = NULL, *atom = NULL;
+	unsigned char *data = NULL;
+	XWindowAttributes wa;
+	XClassHint ch = { NULL, NULL };
+	Window trans = None;
+	Atom realtype;
+	int format;
+	unsigned long i, n, extra;
+	uint32_t v;
+
+	if (!rec)
+		return;
+	r.ns = statnow() - start;
+	r.type = ev->type;
+	r.window = recwin(ev->xany.window);
+	switch (ev->type) {
+	case MapRequest:
+		r.window = recwin(ev->xmaprequest.window);
+		if (XGetWindowAttributes(dpy, ev->xmaprequest.window, &wa)) {
+			r.x = wa.x; r.y = wa.y; r.w = wa.width; r.h = wa.height;
+		}
+		if (XGetTransientForHint(dpy, ev->xmaprequest.window, &trans))
+			r.extra = recwin(trans);
+		XGetClassHint(dpy, ev->xmaprequest.window, &ch);
+		XFetchName(dpy, ev->xmaprequest.window, &title);
+		setstr(&r, s, 0, ch.res_name, ch.res_name ? strlen(ch.res_name) : 0);
+		setstr(&r, s, 1, ch.res_class, ch.res_class ? strlen(ch.res_class) : 0);
+		setstr(&r, s, 2, title, title ? strlen(title) : 0);
+		break;
+	case PropertyNotify:
+		r.state = ev->xproperty.state;
+		if ((name = XGetAtomName(dpy, ev->xproperty.atom)))
+			setstr(&r, s, 0, name, strlen(name));
+		/* atoms and windows in the value mean nothing on another server */
+		if (ev->xproperty.state == PropertyNewValue
+		&& XGetWindowProperty(dpy, ev->xproperty.window, ev->xproperty.atom, 0L,
+			RECMAXPROP / 4, False, AnyPropertyType, &realtype, &format, &n,
+			&extra, &data) == Success && data && realtype != XA_ATOM
+		&& realtype != XA_WINDOW) {
+			r.detail = format;
+			if ((type = XGetAtomName(dpy, realtype)))
+				setstr(&r, s, 1, type, strlen(type));
+			/* Xlib hands out format 32 items as longs, keep 32 bits each */
+			if (format == 32)
+				for (i = 0; i < n; i++) {
+					v = ((long *)data)[i];
+					memcpy(data + 4 * i, &v, 4);
+				}
+			setstr(&r, s, 2, (char *)data, n * (format / 8));
+		}
+		break;
+	case ConfigureRequest:
+		r.window = recwin(ev->xconfigurerequest.window);
+		r.x = ev->xconfigurerequest.x; r.y = ev->xconfigurerequest.y;
+		r.w = ev->xconfigurerequest.width; r.h = ev->xconfigurerequest.height;
+		r.detail = ev->xconfigurerequest.value_mask;
+		r.state = ev->xconfigurerequest.detail;
+		break;
+	case ClientMessage:
+		r.detail = ev->xclient.data.l[0];
+		if ((name = XGetAtomName(dpy, ev->xclient.message_type)))
+			setstr(&r, s, 0, name, strlen(name));
+		if (ev->xclient.message_type == netwmstate && ev->xclient.data.l[1]
+		&& (atom = XGetAtomName(dpy, ev->xclient.data.l[1])))
+			setstr(&r, s, 1, atom, strlen(atom));
+		break;
+	case KeyPress:
+	case KeyRelease:
+		r.x = ev->xkey.x_root; r.y = ev->xkey.y_root;
+		r.detail = XKeycodeToKeysym(dpy, (KeyCode)ev->xkey.keycode, 0);
+		r.state = ev->xkey.state;
+		break;
+	case ButtonPress:
+	case ButtonRelease:
+		r.x = ev->xbutton.x_root; r.y = ev->xbutton.y_root;
+		r.detail = ev->xbutton.button;
+		r.state = ev->xbutton.state;
+		break;
+	case MotionNotify:
+		r.x = ev->xmotion.x_root; r.y = ev->xmotion.y_root;
+		r.state = ev->xmotion.state;
+		break;
+	case EnterNotify:
+		r.x = ev->xcrossing.x_root; r.y = ev->xcrossing.y_root;
+		r.state = ev->xcrossing.state;
+		break;
+	case DestroyNotify:
+		r.window = recwin(ev->xdestroywindow.window);
+		break;
+	case UnmapNotify:
+		r.window = recwin(ev->xunmap.window);
+		r.flags = ev->xunmap.send_event;
+		break;
+	case ConfigureNotify:
+		r.window = recwin(ev->xconfigure.window);
+		r.x = ev->xconfigure.x; r.y = ev->xconfigure.y;
+		r.w = ev->xconfigure.width; r.h = ev->xconfigure.height;
+		break;
+	case Expose:
+		r.x = ev->xexpose.x; r.y = ev->xexpose.y;
+		r.w = ev->xexpose.width; r.h = ev->xexpose.height;
+		break;
+	}
+	put(&r, s);
+	if (ch.res_name)
+		XFree(ch.res_name);
+	if (ch.res_class)
+		XFree(ch.res_class);
+	if (title)
+		XFree(title);
+	if (name)
+		XFree(name);
+	if (type)
+		XFree(type);
+	if (atom)
+		XFree(atom);
+	if (data)
+		XFree(data);
+}
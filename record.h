@@ -0,0 +1,48 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+/* See LICENSE file for copyright and license details.
+ *
+ * Event recording, see `dwm -r'. A recording is a RecHdr followed by one
+ * RecEv per event dwm read, each followed by its three strings
+ * (len[0..2] bytes, not terminated). Window ids are the recorder's, the root
+ * window is 0. Integers are in host byte order; replay on the same kind of
+ * machine.
+ */
+
+#include <stdint.h>
+
+#define RECMAGIC    0x64776d72u /* "dwmr" */
+#define RECVER      3
+#define RECMAXPROP  (256 * 1024) /* property bytes kept per PropertyNotify */
+
+typedef struct {
+	uint32_t magic, version;
+	uint32_t sw, sh; /* root window size */
+} RecHdr;
+
+/* meaning of the fields by event type:
+ *   MapRequest        x y w h, extra = transient-for, s = res_name res_class title
+ *   PropertyNotify    state, detail = format, s = atom type data (NewValue only,
+ *                     format 32 items are stored as 32 bits, not as longs)
+ *   ConfigureRequest  x y w h, detail = value_mask, state = stack_mode
+ *   ClientMessage     detail = data.l[0], s = message_type and atom data.l[1]
+ *   Key*, Button*     x y = root position, detail = keysym/button, state
+ *   MotionNotify, EnterNotify  x y = root position, state
+ *   UnmapNotify       flags = send_event
+ *   ConfigureNotify, Expose    x y w h
+ */
+typedef struct {
+	uint64_t ns;       /* since recording started */
+	uint32_t window, extra, detail, state;
+	int16_t x, y;
+	uint16_t w, h;
+	uint8_t type, flags;
+	uint32_t len[3];
+} RecEv;
+
+int recopen(Display *dpy, const char *path);
+void recevent(Display *dpy, XEvent *ev);
+void recclose(void);
+
+#endif
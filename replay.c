@@ -0,0 +1,392 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Plays a recording made with `dwm -r' back against a fresh dwm, usually on
+ * Xvfb, and reports the CPU time, X requests and handler latencies dwm spent
+ * on it. Client windows are recreated like transient.c does, input is sent
+ * through XTest. Events that dwm causes itself (focus, expose, crossing from
+ * restacking) are not replayed; they follow from the rest.
+ *
+ * usage: replay [-t] file dwm [arg ...]
+ *   -t  keep the recorded timing instead of replaying as fast as possible
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <X11/keysym.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XTest.h>
+
+#include "record.h"
+#include "stats.h"
+#include "util.h"
+
+#define MAXSNAP 256
+
+typedef struct {
+	char name[64];
+	int hist;
+	unsigned long long count, total, max; /* count is the value of counters */
+} Snap;
+
+typedef struct {
+	uint32_t rec;
+	Window win;
+} WinMap;
+
+static Display *dpy;
+static Window root;
+static WinMap *wins;
+static size_t nwins, winscap;
+static unsigned long played, skipped;
+
+static int
+xerror(Display *dpy, XErrorEvent *ee)
+{
+	return 0; /* windows recorded twice or already gone */
+}
+
+static Window
+win(uint32_t rec, int create)
+{
+	size_t i;
+
+	if (!rec)
+		return root;
+	for (i = 0; i < nwins; i++)
+		if (wins[i].rec == rec)
+			return wins[i].win;
+	if (!create)
+		return None;
+	if (nwins == winscap) {
+		winscap = winscap ? winscap * 2 : 64;
+		if (!(wins = realloc(wins, winscap * sizeof *wins)))
+			die("replay: realloc:");
+	}
+	wins[nwins].rec = rec;
+	wins[nwins].win = XCreateSimpleWindow(dpy, root, 0, 0, 1, 1, 0, 0, 0);
+	return wins[nwins++].win;
+}
+
+static void
+sleepns(uint64_t ns)
+{
+	struct timespec ts = { ns / 1000000000u, ns % 1000000000u };
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static void
+modifiers(unsigned int state, Bool press)
+{
+	const struct { unsigned int mask; KeySym sym; } mods[] = {
+		{ ShiftMask, XK_Shift_L }, { ControlMask, XK_Control_L },
+		{ Mod1Mask, XK_Alt_L }, { Mod4Mask, XK_Super_L },
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof mods / sizeof mods[0]; i++)
+		if (state & mods[i].mask)
+			XTestFakeKeyEvent(dpy, XKeysymToKeycode(dpy, mods[i].sym), press, 0);
+}
+
+static void
+play(RecEv *r, char *s[3])
+{
+	Window w;
+	XClassHint ch;
+	XWindowChanges wc;
+	XEvent ev;
+	Atom type;
+	unsigned char *data;
+	unsigned long i, n;
+	uint32_t v;
+
+	switch (r->type) {
+	case MapRequest:
+		if ((w = win(r->window, 0)) == None) {
+			w = win(r->window, 1);
+			XMoveResizeWindow(dpy, w, r->x, r->y, MAX(r->w, 1), MAX(r->h, 1));
+			ch.res_name = s[0] ? s[0] : "";
+			ch.res_class = s[1] ? s[1] : "";
+			XSetClassHint(dpy, w, &ch);
+			if (s[2])
+				XStoreName(dpy, w, s[2]);
+			if (r->extra)
+				XSetTransientForHint(dpy, w, win(r->extra, 1));
+		}
+		XMapWindow(dpy, w);
+		break;
+	case DestroyNotify:
+		if ((w = win(r->window, 0)) != None && w != root)
+			XDestroyWindow(dpy, w);
+		break;
+	case UnmapNotify:
+		if ((w = win(r->window, 0)) != None && w != root)
+			XUnmapWindow(dpy, w);
+		break;
+	case PropertyNotify:
+		if (!s[0] || (w = win(r->window, r->window == 0)) == None)
+			goto skip;
+		if (r->state == PropertyDelete)
+			XDeleteProperty(dpy, w, XInternAtom(dpy, s[0], False));
+		else if (s[1] && (r->detail == 8 || r->detail == 16 || r->detail == 32)) {
+			type = XInternAtom(dpy, s[1], False);
+			n = r->len[2] / (r->detail / 8);
+			data = (unsigned char *)s[2];
+			if (r->detail == 32) {
+				/* recorded as 32 bits per item, Xlib wants longs */
+				data = ecalloc(n + 1, sizeof(long));
+				for (i = 0; i < n; i++) {
+					memcpy(&v, s[2] + 4 * i, 4);
+					((long *)data)[i] = v;
+				}
+			}
+			XChangeProperty(dpy, w, XInternAtom(dpy, s[0], False), type, r->detail,
+				PropModeReplace, data, n);
+			if (data != (unsigned char *)s[2])
+				free(data);
+		} else
+			goto skip;
+		break;
+	case ConfigureRequest:
+		if ((w = win(r->window, 0)) == None)
+			goto skip;
+		wc.x = r->x; wc.y = r->y;
+		wc.width = MAX(r->w, 1); wc.height = MAX(r->h, 1);
+		wc.stack_mode = r->state;
+		XConfigureWindow(dpy, w, r->detail & ~CWSibling, &wc);
+		break;
+	case ClientMessage:
+		if (!s[0] || (w = win(r->window, 0)) == None)
+			goto skip;
+		memset(&ev, 0, sizeof ev);
+		ev.xclient.type = ClientMessage;
+		ev.xclient.window = w;
+		ev.xclient.message_type = XInternAtom(dpy, s[0], False);
+		ev.xclient.format = 32;
+		ev.xclient.data.l[0] = r->detail;
+		if (s[1])
+			ev.xclient.data.l[1] = XInternAtom(dpy, s[1], False);
+		XSendEvent(dpy, root, False, SubstructureNotifyMask|SubstructureRedirectMask, &ev);
+		break;
+	case KeyPress:
+		modifiers(r->state, True);
+		XTestFakeKeyEvent(dpy, XKeysymToKeycode(dpy, r->detail), True, 0);
+		XTestFakeKeyEvent(dpy, XKeysymToKeycode(dpy, r->detail), False, 0);
+		modifiers(r->state, False);
+		break;
+	case ButtonPress:
+		XTestFakeMotionEvent(dpy, -1, r->x, r->y, 0);
+		modifiers(r->state, True);
+		XTestFakeButtonEvent(dpy, r->detail, True, 0);
+		modifiers(r->state, False);
+		break;
+	case ButtonRelease:
+		XTestFakeMotionEvent(dpy, -1, r->x, r->y, 0);
+		XTestFakeButtonEvent(dpy, r->detail, False, 0);
+		break;
+	case MotionNotify:
+	case EnterNotify:
+		XTestFakeMotionEvent(dpy, -1, r->x, r->y, 0);
+		break;
+	default:
+		goto skip;
+	}
+	played++;
+	return;
+skip:
+	skipped++;
+}
+
+/* dwm is up once it advertises itself on the root window */
+static int
+wmrunning(void)
+{
+	Atom type;
+	int format;
+	unsigned long n = 0, extra;
+	unsigned char *p = NULL;
+
+	if (XGetWindowProperty(dpy, root, XInternAtom(dpy, "_NET_SUPPORTING_WM_CHECK", False),
+		0, 1, False, XA_WINDOW, &type, &format, &n, &extra, &p) != Success || !p)
+		return 0;
+	XFree(p);
+	return n > 0;
+}
+
+/* utime + stime of pid in ns */
+static unsigned long long
+cputime(pid_t pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long ut = 0, st = 0;
+	FILE *f;
+	int i;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", (int)pid);
+	if (!(f = fopen(path, "r")))
+		return 0;
+	p = fgets(buf, sizeof buf, f);
+	fclose(f);
+	if (!p || !(p = strrchr(buf, ')')))
+		return 0;
+	/* field 3 follows the command name, utime and stime are 14 and 15 */
+	for (i = 3, p++; i < 14 && p; i++)
+		p = strchr(p + 1, ' ');
+	if (!p || sscanf(p, "%llu %llu", &ut, &st) != 2)
+		return 0;
+	return (ut + st) * (1000000000ull / sysconf(_SC_CLK_TCK));
+}
+
+static size_t
+snapshot(pid_t pid, Snap *snap)
+{
+	char path[64], line[2048], kind[16];
+	FILE *f = NULL;
+	size_t n = 0;
+	int i;
+
+	snprintf(path, sizeof path, "%s.%d", STATFILE, (int)pid);
+	unlink(path);
+	kill(pid, SIGUSR1);
+	for (i = 0; i < 100 && !(f = fopen(path, "r")); i++)
+		sleepns(10000000);
+	if (!f)
+		die("replay: dwm wrote no stats");
+	while (n < MAXSNAP && fgets(line, sizeof line, f)) {
+		memset(&snap[n], 0, sizeof snap[n]);
+		if (sscanf(line, "%15s %63s %llu %llu %llu", kind, snap[n].name,
+			&snap[n].count, &snap[n].total, &snap[n].max) < 3)
+			continue;
+		snap[n].hist = !strcmp(kind, "hist");
+		if (snap[n].hist || !strcmp(kind, "counter"))
+			n++;
+	}
+	fclose(f);
+	unlink(path);
+	return n;
+}
+
+static const Snap *
+find(const Snap *snap, size_t n, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (!strcmp(snap[i].name, name))
+			return &snap[i];
+	return NULL;
+}
+
+static void
+report(Snap *a, size_t na, Snap *b, size_t nb, unsigned long long cpu)
+{
+	const Snap *s, *p;
+	unsigned long long count, total;
+	size_t i;
+
+	printf("events     %lu replayed, %lu not replayable\n", played, skipped);
+	printf("cpu        %.3f ms\n", cpu / 1e6);
+	if ((s = find(b, nb, "requests")) && (p = find(a, na, "requests")))
+		printf("requests   %llu\n", s->count - p->count);
+	printf("%-28s %10s %12s %12s\n", "handler", "calls", "mean us", "max us");
+	for (i = 0; i < nb; i++) {
+		if (!b[i].hist)
+			continue;
+		p = find(a, na, b[i].name);
+		count = b[i].count - (p ? p->count : 0);
+		total = b[i].total - (p ? p->total : 0);
+		if (count)
+			printf("%-28s %10llu %12.2f %12.2f\n", b[i].name, count,
+				total / 1e3 / count, b[i].max / 1e3);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static Snap before[MAXSNAP], after[MAXSNAP];
+	size_t nbefore, nafter;
+	unsigned long long cpu;
+	int i, timed = 0, evb, erb, maj, min;
+	uint64_t t0 = 0;
+	RecHdr h;
+	RecEv r;
+	char *s[3];
+	FILE *f;
+	pid_t pid;
+
+	if (argc > 1 && !strcmp(argv[1], "-t")) {
+		timed = 1;
+		argv++;
+		argc--;
+	}
+	if (argc < 3)
+		die("usage: replay [-t] file dwm [arg ...]");
+	if (!(f = fopen(argv[1], "rb")))
+		die("replay: cannot open %s:", argv[1]);
+	if (fread(&h, sizeof h, 1, f) != 1 || h.magic != RECMAGIC)
+		die("replay: %s: not a dwm recording", argv[1]);
+	if (h.version != RECVER)
+		die("replay: %s: recording version %u, expected %u", argv[1], h.version, RECVER);
+	if (!(dpy = XOpenDisplay(NULL)))
+		die("replay: cannot open display");
+	if (!XTestQueryExtension(dpy, &evb, &erb, &maj, &min))
+		die("replay: no XTest extension");
+	XSetErrorHandler(xerror);
+	root = DefaultRootWindow(dpy);
+	if (DisplayWidth(dpy, DefaultScreen(dpy)) != (int)h.sw
+	|| DisplayHeight(dpy, DefaultScreen(dpy)) != (int)h.sh)
+		fprintf(stderr, "replay: recorded on a %ux%u screen\n", h.sw, h.sh);
+
+	if ((pid = fork()) == 0) {
+		execvp(argv[2], argv + 2);
+		_exit(127);
+	}
+	for (i = 0; i < 500 && !wmrunning(); i++) {
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			die("replay: %s exited", argv[2]);
+		sleepns(10000000);
+	}
+	sleepns(200000000); /* scan() and autostart */
+	nbefore = snapshot(pid, before);
+	cpu = cputime(pid);
+
+	while (fread(&r, sizeof r, 1, f) == 1) {
+		for (i = 0; i < 3; i++) {
+			s[i] = NULL;
+			if (!r.len[i])
+				continue;
+			if (!(s[i] = malloc(r.len[i] + 1)) || fread(s[i], 1, r.len[i], f) != r.len[i])
+				die("replay: %s: truncated recording", argv[1]);
+			s[i][r.len[i]] = '\0';
+		}
+		if (timed && t0 && r.ns > t0)
+			sleepns(r.ns - t0);
+		t0 = r.ns;
+		play(&r, s);
+		XFlush(dpy);
+		for (i = 0; i < 3; i++)
+			free(s[i]);
+	}
+	fclose(f);
+	XSync(dpy, False);
+	sleepns(500000000); /* let dwm drain its queue */
+
+	nafter = snapshot(pid, after);
+	cpu = cputime(pid) - cpu;
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	report(before, nbefore, after, nafter, cpu);
+	XCloseDisplay(dpy);
+	return EXIT_SUCCESS;
+}
@@ -469,6 +469,7 @@ void s_recur_resize(node_t *node, struct frame_t frame)
 void s_layout(Monitor *m)
 {
    // Need to clone the client stack, as we might need to pull items from it.
+   uint64_t t0 = statnow();
    struct client_ref_t *clients = copy_clients(m->clients),
                        *clients_root = clients;
 
@@ -488,6 +489,7 @@ void s_layout(Monitor *m)
    // Free the resources we allocated.
    free_clients(clients_root);
    free_node(ret.head);
+   stathist(&slayouthist, t0);
 }
 
 // Tokenize string
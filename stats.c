@@ -0,0 +1,165 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "util.h"
+
+#define MAXSTATS 128
+
+typedef struct {
+	const char *name, *sub; /* printed as name.sub */
+	Hist *h;
+	const unsigned long *c;
+} Stat;
+
+static Stat stats[MAXSTATS];
+static unsigned int nstats;
+static char path[64], tmppath[68];
+
+/* the dump runs in a signal handler, so no stdio below */
+static char out[4096];
+static size_t outn;
+static int outfd;
+
+static void
+flush(void)
+{
+	size_t off = 0;
+	ssize_t r;
+
+	while (off < outn && (r = write(outfd, out + off, outn - off)) > 0)
+		off += r;
+	outn = 0;
+}
+
+static void
+putstr(const char *s)
+{
+	for (; *s; s++) {
+		if (outn == sizeof out)
+			flush();
+		out[outn++] = *s;
+	}
+}
+
+static void
+putnum(uint64_t v)
+{
+	char buf[24], *p = buf + sizeof buf - 1;
+
+	*p = '\0';
+	do
+		*--p = '0' + v % 10;
+	while (v /= 10);
+	putstr(" ");
+	putstr(p);
+}
+
+static void
+putname(const Stat *s)
+{
+	putstr(" ");
+	putstr(s->name);
+	if (s->sub) {
+		putstr(".");
+		putstr(s->sub);
+	}
+}
+
+static void
+statdump(int unused)
+{
+	unsigned int i, j;
+	int e = errno;
+
+	/* readers only ever see a complete dump */
+	if ((outfd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
+		errno = e;
+		return;
+	}
+	putstr("dwmstats");
+	putnum(STATVER);
+	putnum(statnow());
+	putstr("\n");
+	for (i = 0; i < nstats; i++) {
+		if (stats[i].h) {
+			putstr("hist");
+			putname(&stats[i]);
+			putnum(stats[i].h->count);
+			putnum(stats[i].h->total);
+			putnum(stats[i].h->max);
+			for (j = 0; j < STATBUCKETS; j++)
+				putnum(stats[i].h->bucket[j]);
+		} else {
+			putstr("counter");
+			putname(&stats[i]);
+			putnum(*stats[i].c);
+		}
+		putstr("\n");
+	}
+	flush();
+	close(outfd);
+	rename(tmppath, path);
+	errno = e;
+}
+
+uint64_t
+statnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void
+stathist(Hist *h, uint64_t start)
+{
+	statadd(h, statnow() - start);
+}
+
+void
+statadd(Hist *h, uint64_t v)
+{
+	unsigned int b = 63 - __builtin_clzll(v | 1);
+
+	h->count++;
+	h->total += v;
+	if (v > h->max)
+		h->max = v;
+	h->bucket[MIN(b, STATBUCKETS - 1)]++;
+}
+
+void
+stathistreg(const char *name, const char *sub, Hist *h)
+{
+	if (nstats < MAXSTATS)
+		stats[nstats++] = (Stat){ name, sub, h, NULL };
+}
+
+void
+statcountreg(const char *name, const char *sub, const unsigned long *c)
+{
+	if (nstats < MAXSTATS)
+		stats[nstats++] = (Stat){ name, sub, NULL, c };
+}
+
+void
+statinit(void)
+{
+	struct sigaction sa;
+
+	snprintf(path, sizeof path, "%s.%d", STATFILE, (int)getpid());
+	snprintf(tmppath, sizeof tmppath, "%s.tmp", path);
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = statdump;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
@@ -0,0 +1,35 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/* See LICENSE file for copyright and license details.
+ *
+ * Always-on latency histograms and counters. SIGUSR1 writes everything that
+ * was registered to STATFILE.<pid>, one entry per line:
+ *
+ *   hist <name> <count> <total_ns> <max_ns> <b0> ... <b31>
+ *   counter <name> <value>
+ *
+ * Bucket i counts latencies in [2^i, 2^(i+1)) ns; b0 also holds 0 and b31
+ * everything from 2^31 ns up. Histograms filled with statadd() count other
+ * units in the same buckets, e.g. pixels; their name says which.
+ */
+
+#include <stdint.h>
+
+#define STATFILE     "/tmp/dwm.stats"
+#define STATVER      1
+#define STATBUCKETS  32
+
+typedef struct {
+	uint64_t count, total, max;
+	uint64_t bucket[STATBUCKETS];
+} Hist;
+
+uint64_t statnow(void);
+void stathist(Hist *h, uint64_t start);
+void statadd(Hist *h, uint64_t v);
+void stathistreg(const char *name, const char *sub, Hist *h);
+void statcountreg(const char *name, const char *sub, const unsigned long *c);
+void statinit(void);
+
+#endif
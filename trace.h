@@ -0,0 +1,55 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/* See LICENSE file for copyright and license details.
+ *
+ * Compile-time tracing. Build with -DTRACING (see config.mk) to record
+ * fixed-size binary records into an in-memory ring; SIGUSR2 dumps the ring to
+ * TRACEFILE.<pid> and `tracedump' decodes it. Without -DTRACING every TRACE()
+ * expands to nothing.
+ */
+
+#include <stdint.h>
+
+#define TRACEFILE   "/tmp/dwm.trace"
+#define TRACEMAGIC  0x64776d74u /* "dwmt" */
+#define TRACEVER    1
+#define TRACERECS   4096        /* ring size, must be a power of two */
+
+/* record types, tracedump.c has the matching names */
+enum {
+	TraceEvent,      /* type, window */
+	TraceResize,     /* window, x, y, w, h */
+	TraceTileMaster, /* window, x, y, w, h */
+	TraceTileStack,  /* window, x, y, w, h */
+	TraceTileSide,   /* window, x, y, w, h */
+	TraceManage,     /* window, monitor */
+	TraceUnmanage,   /* window, destroyed */
+	TraceCommit,     /* monitor, dirty flags */
+	TraceLast
+};
+
+typedef struct {
+	uint64_t ns;     /* CLOCK_MONOTONIC */
+	uint32_t type;
+	int32_t a[5];
+} TraceRec;
+
+typedef struct {
+	uint32_t magic, version, recsize, nrecs;
+	uint64_t head;   /* records written since start, the ring holds the last nrecs */
+} TraceHdr;
+
+void traceinit(void);
+void tracerec(uint32_t type, int32_t a0, int32_t a1, int32_t a2, int32_t a3, int32_t a4);
+
+#ifdef TRACING
+#define TRACE(t, a0, a1, a2, a3, a4) \
+	tracerec((t), (int32_t)(a0), (int32_t)(a1), (int32_t)(a2), (int32_t)(a3), (int32_t)(a4))
+#define TRACEINIT() traceinit()
+#else
+#define TRACE(t, a0, a1, a2, a3, a4)
+#define TRACEINIT()
+#endif
+
+#endif
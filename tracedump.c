@@ -0,0 +1,81 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Decodes a trace ring written by dwm on SIGUSR2, oldest record first.
+ * usage: tracedump /tmp/dwm.trace.<pid>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+static const char *names[TraceLast] = {
+	[TraceEvent]      = "event",
+	[TraceResize]     = "resize",
+	[TraceTileMaster] = "tile-master",
+	[TraceTileStack]  = "tile-stack",
+	[TraceTileSide]   = "tile-side",
+	[TraceManage]     = "manage",
+	[TraceUnmanage]   = "unmanage",
+	[TraceCommit]     = "commit",
+};
+
+int
+main(int argc, char *argv[])
+{
+	FILE *f;
+	TraceHdr h;
+	TraceRec *ring, *r;
+	uint64_t i, first, t0 = 0;
+
+	if (argc != 2) {
+		fputs("usage: tracedump file\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if (!(f = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (fread(&h, sizeof h, 1, f) != 1 || h.magic != TRACEMAGIC
+	|| h.version != TRACEVER || h.recsize != sizeof(TraceRec)
+	|| !h.nrecs || (h.nrecs & (h.nrecs - 1))) {
+		fprintf(stderr, "%s: not a dwm trace\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (!(ring = calloc(h.nrecs, sizeof(TraceRec)))
+	|| fread(ring, sizeof(TraceRec), h.nrecs, f) != h.nrecs) {
+		fprintf(stderr, "%s: short trace\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	fclose(f);
+
+	first = h.head > h.nrecs ? h.head - h.nrecs : 0;
+	for (i = first; i < h.head; i++) {
+		r = &ring[i & (h.nrecs - 1)];
+		if (r->type >= TraceLast)
+			continue;
+		if (!t0)
+			t0 = r->ns;
+		printf("%12.3f %-12s", (double)(r->ns - t0) / 1e3, names[r->type]);
+		switch (r->type) {
+		case TraceEvent:
+			printf(" type=%d win=0x%x\n", r->a[0], (unsigned)r->a[1]);
+			break;
+		case TraceManage:
+			printf(" win=0x%x mon=%d\n", (unsigned)r->a[0], r->a[1]);
+			break;
+		case TraceUnmanage:
+			printf(" win=0x%x destroyed=%d\n", (unsigned)r->a[0], r->a[1]);
+			break;
+		case TraceCommit:
+			printf(" mon=%d dirty=0x%x\n", r->a[0], (unsigned)r->a[1]);
+			break;
+		default:
+			printf(" win=0x%x %d,%d %dx%d\n", (unsigned)r->a[0],
+				r->a[1], r->a[2], r->a[3], r->a[4]);
+		}
+	}
+	printf("%llu records, %llu overwritten\n", (unsigned long long)(h.head - first),
+		(unsigned long long)first);
+	free(ring);
+	return EXIT_SUCCESS;
+}